@@ -1,6 +1,10 @@
 #ifndef FILESYSFUNC_H
 #define FILESYSFUNC_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
 #include "lexer.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,11 +13,68 @@
 #include <unistd.h>
 #include <fcntl.h> // Include for open
 #include <ctype.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h> // BLKSSZGET
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdarg.h>
+#include <fnmatch.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
 
 #define MAX_STACK_SIZE 128
+#define MAX_NAME_LENGTH 255 // Longest path component, a VFAT long name
+#define MAX_PATH_LENGTH 256
 #define ATTR_DIRECTORY 0x10
+#define ATTR_LONG_NAME 0x0F
 #define ENTRY_SIZE 32
 #define MAX_OPEN_FILES 10
+#define FREE_CHUNK_CLUSTERS 4096
+#define FAT_FLUSH_GAP 8 // Clean FAT sectors a flush may rewrite to join two dirty runs
+#define CACHE_DEFAULT_BUDGET (4 * 1024 * 1024)
+#define CACHE_MIN_ENTRIES 16
+#define URING_ENTRIES 64
+#define PREFETCH_MAX_CLUSTERS 256 // Largest batch a single listing or read submits
+#define READAHEAD_MIN_CLUSTERS 4
+#define READAHEAD_MAX_CLUSTERS 128
+#define IO_MAX_IOV 256                // Clusters gathered into one preadv/pwritev
+#define IO_RUN_MAX_BYTES (1024 * 1024) // Largest single read of a contiguous file run
+#define READ_IOV_BATCH 64              // Mapped pieces of a read gathered into one writev
+#define IO_ALIGNMENT 4096              // Least buffer alignment, raised to the device's O_DIRECT block size
+#define RAMDISK_CHUNK_SIZE (64 * 1024) // Granularity at which the RAM disk tracks unsaved writes
+#define DENTRY_CACHE_SIZE 1024     // Direct-mapped (directory, name) lookup results
+#define CACHE_SECTOR_WORDS 2       // Dirty bits for up to 128 sectors per cluster
+#define DIR_INDEX_SLOTS 8          // Directories whose name index is kept at once
+#define DIR_INDEX_MIN_CAPACITY 64
+#define DIR_INDEX_EMPTY 0
+#define DIR_INDEX_USED 1
+#define DIR_INDEX_DELETED 2
+#define COMPACT_MIN_TOMBSTONES 64 // Fewer deleted entries never trigger automatic compaction
+#define LFN_CHARS_PER_ENTRY 13 // UCS-2 characters held by one long name entry
+#define LFN_MAX_ENTRIES 20
+#define LFN_MAX_CHARS 255
+#define LFN_NAME_BUFFER (LFN_MAX_CHARS * 3 + 1) // A long name in UTF-8 at its longest
+#define OUTPUT_BUFFER_SIZE (64 * 1024) // Bytes a listing gathers before each write to stdout
+#define WALK_MAX_THREADS 16            // Upper bound on tree walk workers
+#define WALK_RUN_CLUSTERS 16           // Contiguous directory clusters a walker reads at once
+#define WALK_MAX_DEPTH 128             // Deeper directories are taken as a loop in a damaged image
+#define LS_COLUMNS 6                   // Names per line in the short listing
+#define LFN_LAST_ENTRY 0x40    // Ordinal flag of the entry holding the end of the name
+#define DURABILITY_NONE 0        // Write back only on sync, eviction and unmount
+#define DURABILITY_PER_COMMAND 1 // Sync after every command
+#define DURABILITY_PERIODIC 2    // A flusher thread syncs every syncIntervalMs
+#define SYNC_DEFAULT_INTERVAL_MS 1000
+#define JOURNAL_MAGIC 0x314C4E4A       // "JNL1"
+#define JOURNAL_BLOCK 1
+#define JOURNAL_COMMIT 2
+#define JOURNAL_CHECKPOINT_BYTES (8 * 1024 * 1024) // Journal size that triggers a checkpoint
 
 typedef struct
 {
@@ -21,10 +82,12 @@ typedef struct
     uint8_t sectorsPerCluster;
     uint32_t totalSectors;
     uint32_t FATSize;
+    uint16_t extFlags;
     uint32_t rootCluster;
     uint16_t reservedSectors;
     uint8_t numFATs;
     uint32_t firstDataSector;
+    uint16_t fsInfoSector;
 } FAT32BootSector;
 
 typedef struct __attribute__((packed)) directory_entry
@@ -40,15 +103,243 @@ typedef struct __attribute__((packed)) directory_entry
 
 typedef struct
 {
-    char filename[12];
+    uint32_t fileCluster; // Index of the run's first cluster within the file
+    uint32_t diskCluster; // Cluster number of the run's first cluster on disk
+    uint32_t length;      // Number of physically contiguous clusters
+} ClusterExtent;
+
+typedef struct
+{
+    char filename[MAX_NAME_LENGTH + 1]; // Last component of the path it was opened with
+    char path[MAX_PATH_LENGTH];          // Path as given to open, for lsof
+    uint32_t dirCluster;                 // Directory holding the file; with fatName identifies it
+    uint8_t fatName[11];
     char mode[4];
-    int offset;
+    uint32_t offset; // FAT32 files reach 4 GiB - 1, past what an int holds
     int isOpeninuse;
     int lastSessionId;
     int sessionId;
     uint32_t cluster; // Starting cluster of the file
+    ClusterExtent *extents; // Lazily built map of the cluster chain, sorted by fileCluster
+    uint32_t extentCount;
+    uint32_t extentCapacity;
+    bool extentsValid;
+    uint32_t lastReadEnd;     // Offset where the previous read stopped, for stream detection
+    uint32_t readaheadWindow; // Clusters to load ahead of a sequential reader, 0 when not streaming
+    uint32_t readaheadEnd;    // File offset up to which readahead has been issued
+    bool seeked;              // lseek moved the offset since the last read
 } OpenFile;
 
+typedef struct
+{
+    uint32_t dirCluster; // First cluster of the directory searched, 0 when unused
+    uint8_t name[11];
+    bool found;          // false records that the name does not exist
+    uint32_t cluster;    // Where the entry lives when found
+    uint32_t slot;
+} DentryCacheEntry;
+
+typedef struct
+{
+    uint8_t name[11]; // Name as stored in the entry
+    uint8_t state;    // DIR_INDEX_EMPTY, DIR_INDEX_USED or DIR_INDEX_DELETED
+    uint32_t cluster; // Directory cluster holding the entry
+    uint32_t slot;    // Entry number within that cluster
+} DirIndexEntry;
+
+typedef struct
+{
+    char *name;            // Long name as stored, compared without regard to case
+    uint8_t shortName[11]; // Short alias of the entry carrying the name
+    uint8_t state;         // DIR_INDEX_EMPTY, DIR_INDEX_USED or DIR_INDEX_DELETED
+} LongNameEntry;
+
+typedef struct
+{
+    uint16_t chars[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    uint8_t checksum; // Checksum every piece must carry
+    uint8_t next;     // Ordinal of the piece expected next
+    uint8_t count;    // Pieces in the sequence
+    bool valid;
+} LfnState;
+
+typedef struct
+{
+    uint32_t dirCluster;    // First cluster of the indexed directory, 0 when unused
+    uint32_t *chain;        // Clusters of the directory, maps entry writes back to the index
+    uint32_t chainCount;
+    uint32_t chainCapacity;
+    DirIndexEntry *table;   // Open addressing, capacity is a power of two
+    uint32_t capacity;
+    uint32_t used;          // Live entries plus tombstones
+    LongNameEntry *longTable; // Long names to short aliases, allocated on the first long name
+    uint32_t longCapacity;
+    uint32_t longUsed;
+    uint32_t freePos;       // Chain position and slot of the first entry that may be free,
+    uint32_t freeSlot;      // every entry before it is in use
+    uint32_t endPos;        // Chain position and slot of the end-of-directory marker,
+    uint32_t endSlot;       // a position of chainCount means the chain is full
+    uint32_t tombstones;    // Deleted entries before the end marker
+    uint64_t lastUse;
+} DirIndex;
+
+typedef struct
+{
+    uint32_t cluster; // Cluster held by this slot, 0 when empty
+    uint8_t *data;
+    bool dirty;       // Modified since it was read, written back on flush or eviction
+    bool metadata;    // Directory cluster, journaled when journaling is enabled
+    bool referenced;  // CLOCK bit, set on every access
+    bool loading;     // Read in flight as part of a batch, must not be evicted
+    uint64_t dirtySectors[CACHE_SECTOR_WORDS]; // Sectors to write back, one bit each
+    int32_t next;     // Next slot in the same hash bucket
+} CacheEntry;
+
+typedef struct
+{
+    size_t cacheBudget; // Bytes of cluster data the buffer cache may hold
+    bool useMmap;       // Map the whole image and access clusters in place
+    bool useUring;      // Submit batched cluster I/O through io_uring
+    bool useDirect;     // Open the image with O_DIRECT, bypassing the page cache
+    bool useRamDisk;    // Load the whole image into memory and persist it only on sync
+    bool useJournal;    // Commit metadata through the <image>.jnl write-ahead journal
+    bool checkMirrors;  // Compare every FAT mirror with the primary at mount, repairing drifted sectors
+    int durability;     // One of the DURABILITY_ modes
+    uint32_t syncIntervalMs; // Flush period for DURABILITY_PERIODIC
+} MountOptions;
+
+typedef struct
+{
+    void *buffer;
+    size_t length;
+    off_t offset; // Byte offset in the image
+    bool write;
+    int result;   // 0 once the whole transfer completed, -1 on failure
+    const struct iovec *iov; // When iovCount > 0, scatter/gather over these instead of buffer
+    int iovCount;
+} IoRequest;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;     // JOURNAL_BLOCK followed by length bytes, or JOURNAL_COMMIT
+    uint64_t sequence; // Transaction the record belongs to
+    uint64_t offset;   // Image byte offset the block is written to
+    uint32_t length;   // Block size, or the number of blocks for a commit record
+    uint32_t checksum; // FNV-1a of the block data
+} JournalRecord;
+
+typedef struct BlockDevice BlockDevice;
+struct BlockDevice
+{
+    // Backend operations over byte ranges of the image, offsets are sector aligned
+    ssize_t (*read)(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+    ssize_t (*write)(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+    int (*flush)(BlockDevice *dev);  // Make every completed write durable
+    void (*close)(BlockDevice *dev); // Release the backend, does not flush
+    int fd;                 // Backing image file
+    uint8_t *memory;        // Whole image for the mmap and RAM backends
+    size_t size;
+    bool zeroCopy;          // memory may be handed out and written in place
+    bool unsynced;          // Writes completed since the last flush
+    uint8_t *dirtyChunks;   // RAM backend: chunks written since the last flush
+    size_t alignment;       // O_DIRECT block size that offsets, lengths and buffers must follow, 1 when free
+};
+
+#ifdef HAVE_IO_URING
+typedef struct
+{
+    int ringFd;
+    unsigned entries;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+} IoUring;
+#endif
+
+typedef struct
+{
+    uint32_t cluster;      // Cluster being walked, end of chain once done
+    uint32_t slot;         // Next entry within it
+    uint32_t prefetched;   // Clusters left before the next batch is prefetched
+    LfnState lfn;
+} DirIterator;
+
+typedef struct
+{
+    char name[LFN_NAME_BUFFER]; // Long name when there is one, else the 8.3 name
+    uint8_t shortName[11];
+    uint8_t attr;
+    uint32_t size;
+    uint32_t firstCluster;
+} DirEntryInfo;
+
+typedef struct
+{
+    char *data;
+    size_t used;
+    size_t capacity;
+} OutputBuffer;
+
+typedef struct
+{
+    char *path;        // From the walk's root, components joined with '/'
+    uint32_t size;
+    uint32_t clusters; // Length of the entry's cluster chain
+    uint8_t attr;
+} WalkRecord;
+
+typedef struct
+{
+    char *path;
+    uint32_t cluster;
+    int depth;
+} WalkTask;
+
+typedef struct
+{
+    WalkTask *tasks;  // Pending directories in [head, tail)
+    int head;
+    int tail;
+    int capacity;
+    pthread_mutex_t lock;
+} WalkDeque;
+
+typedef struct TreeWalk TreeWalk;
+
+typedef struct
+{
+    TreeWalk *walk;
+    int id;
+    WalkRecord *records; // Kept per worker, merged once the walk is over
+    size_t count;
+    size_t capacity;
+    uint8_t *buffer;     // Aligned, WALK_RUN_CLUSTERS clusters
+    bool failed;
+} WalkWorker;
+
+struct TreeWalk
+{
+    WalkDeque *deques;   // One per worker, owners pop the newest, thieves take the oldest
+    WalkWorker *workers;
+    int workerCount;
+    pthread_mutex_t idleLock; // Guards pending and queued
+    pthread_cond_t workReady; // Signalled on every push, broadcast once pending drops to 0
+    int pending;         // Directories queued or being scanned
+    int queued;          // Directories sitting in a deque, waiting for a worker
+};
+
+typedef struct
+{
+    const char *path;               // As given, for messages
+    uint32_t dirCluster;            // Directory the file goes into
+    char leaf[MAX_NAME_LENGTH + 1];
+    bool skip;                      // Failed validation or repeats an earlier name
+} BatchEntry;
+
 typedef struct
 {
     char *directoryPath[MAX_STACK_SIZE];
@@ -57,7 +348,44 @@ typedef struct
 } DirectoryStack;
 
 // Function prototypes
-int mountImage(const char *imageName);
+void initMountOptions(MountOptions *options);
+int parseMountOptions(int argc, char **argv, MountOptions *options, const char **imageName);
+int mountImage(const char *imageName, const MountOptions *options);
+void unmountImage();
+void *flusherMain(void *arg);
+int startFlusher();
+void stopFlusher();
+void *alignedAlloc(size_t size);
+BlockDevice *openBlockDevice(const char *imageName, const MountOptions *options);
+BlockDevice *newBlockDevice(int imageFd);
+BlockDevice *openFileDevice(const char *imageName, bool direct);
+size_t directAlignment(int fd);
+bool transferAligned(const BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+ssize_t bounceTransfer(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset, bool write);
+bool ioRequestAligned(const IoRequest *request);
+ssize_t fileDeviceRead(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+ssize_t fileDeviceWrite(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+int fileDeviceFlush(BlockDevice *dev);
+void fileDeviceClose(BlockDevice *dev);
+BlockDevice *openMmapDevice(const char *imageName);
+ssize_t memoryDeviceTransfer(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset, bool write);
+ssize_t memoryDeviceRead(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+ssize_t memoryDeviceWrite(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+int mmapDeviceFlush(BlockDevice *dev);
+void mmapDeviceClose(BlockDevice *dev);
+BlockDevice *openRamDevice(const char *imageName);
+ssize_t ramDeviceWrite(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset);
+int ramDeviceFlush(BlockDevice *dev);
+void ramDeviceClose(BlockDevice *dev);
+int readImage(void *buffer, size_t length, off_t offset);
+int writeImage(const void *buffer, size_t length, off_t offset);
+int ioTransfer(IoRequest *request);
+int submitIoBatch(IoRequest *requests, int count);
+int uringInit(unsigned entries);
+void uringExit();
+#ifdef HAVE_IO_URING
+int uringSubmitBatch(IoRequest *requests, int count);
+#endif
 void printInfo();
 char *popDir();
 void pushDir(const char *dirName, uint32_t cluster);
@@ -65,15 +393,134 @@ void initDirStack();
 void freeDirStack();
 const char *getCurrentDirPath();
 uint32_t clusterToSector(uint32_t cluster);
+int cacheInit(size_t budget);
+void cacheDestroy();
+int32_t cacheLookup(uint32_t cluster);
+void cacheUnlink(int32_t index);
+int32_t cacheClaimSlot();
+uint8_t *cacheLoad(uint32_t cluster, bool readFromDisk);
+uint8_t *cacheGetCluster(uint32_t cluster);
+uint8_t *cacheOverwriteCluster(uint32_t cluster);
+void cacheMarkDirty(uint32_t cluster);
+void cacheMarkMetadata(uint32_t cluster);
+void cacheMarkRange(uint32_t cluster, uint32_t offset, uint32_t length, bool metadata);
+void cacheMarkEntry(uint32_t cluster, const dentry_t *entry);
+bool cacheFullyDirty(const CacheEntry *entry);
+bool nextDirtySectorRun(const CacheEntry *entry, uint32_t *sector, uint32_t *runStart, uint32_t *runEnd);
+int cacheWriteSectorRuns(int32_t *slots, int count, int *results);
+void cacheMarkClean(CacheEntry *entry);
+void cacheDiscard(uint32_t cluster);
+int compareSlotClusters(const void *a, const void *b);
+int transferCacheSlots(int32_t *slots, int count, bool write, int *results);
+int cacheFlush();
+int cacheFlushKinds(bool data, bool metadata);
+void cachePrefetch(const uint32_t *clusters, uint32_t count);
+int readClusterRun(uint32_t cluster, uint32_t count, uint8_t *buffer);
+uint32_t collectChain(uint32_t cluster, uint32_t *clusters, uint32_t max);
 void readCluster(uint32_t clusterNumber, uint8_t *buffer);
 uint32_t readFATEntry(uint32_t clusterNumber);
+int loadFAT(bool checkMirrors);
+void fatCopyRange(uint8_t *firstCopy, uint8_t *lastCopy);
+bool nextDirtyFATRun(uint32_t *sector, uint32_t *runStart, uint32_t *runEnd);
+int flushFAT();
+bool fatMirroringEnabled();
+uint8_t activeFAT();
+off_t fatCopyOffset(uint8_t copy);
+void markStaleMirrorSectors();
+void freeFAT();
+int buildFreeMap();
+void setClusterFree(uint32_t cluster, bool isFree);
+uint32_t findFreeClusterInRange(uint32_t from, uint32_t to);
+uint32_t findFreeCluster(uint32_t start);
+uint32_t freeRunLength(uint32_t cluster, uint32_t max);
+uint32_t findFreeExtent(uint32_t start, uint32_t want, uint32_t *length);
+uint32_t allocateClusters(uint32_t count, uint32_t prevCluster);
+void linkClusterRun(uint32_t firstCluster, uint32_t length);
+void readFSInfo();
+void updateFSInfoBuffer();
+int flushFSInfo();
+int syncImage();
+int journalOpen(const char *imageName, bool enable);
+void journalClose();
+uint32_t journalChecksum(const uint8_t *data, size_t length);
+void journalAppend(uint8_t *log, size_t *used, uint32_t type, uint64_t offset, const void *data, uint32_t length);
+int journalCommit();
+int journalCheckpoint();
+int journalReplay();
 void dbg_print_dentry(dentry_t *dentry);
-uint32_t findDirectoryCluster(const char *dirName);
+void dirIterOpen(DirIterator *iter, uint32_t dirCluster);
+bool dirIterNext(DirIterator *iter, DirEntryInfo *info);
+void shortNameToString(const uint8_t *shortName, char *out);
+bool outInit(OutputBuffer *out, size_t capacity);
+void outPrintf(OutputBuffer *out, const char *format, ...);
+void outFlush(OutputBuffer *out);
+bool writeOutputv(struct iovec *iov, int count);
+bool writeOutput(const void *data, size_t length);
+bool queueOutput(struct iovec *pending, int *pendingCount, const uint8_t *data, size_t length);
+void outFree(OutputBuffer *out);
+void listDirectory(uint32_t cluster, bool longFormat, uint32_t offset, uint32_t limit);
+dentry_t *findDirEntry(uint32_t dirCluster, const char *name, uint32_t *entryCluster);
+bool locateDirEntry(uint32_t dirCluster, const uint8_t *fatName, uint32_t *entryCluster, uint32_t *entrySlot);
+DentryCacheEntry *dentryCacheSlot(uint32_t dirCluster, const uint8_t *fatName);
+DentryCacheEntry *dentryCacheLookup(uint32_t dirCluster, const uint8_t *fatName);
+void dentryCacheStore(uint32_t dirCluster, const uint8_t *fatName, bool found, uint32_t cluster, uint32_t slot);
+void dentryCacheForget(uint32_t dirCluster, const uint8_t *fatName);
+void dentryCacheForgetDirectory(uint32_t dirCluster);
+void dentryCacheReset();
+uint32_t dirIndexHash(const uint8_t *name);
+DirIndexEntry *dirIndexFind(DirIndex *index, const uint8_t *name);
+bool dirIndexResize(DirIndex *index, uint32_t capacity);
+bool dirIndexInsert(DirIndex *index, const uint8_t *name, uint32_t cluster, uint32_t slot);
+bool dirIndexAppendChain(DirIndex *index, uint32_t cluster);
+void dirIndexFree(DirIndex *index);
+bool dirIndexBuild(DirIndex *index, uint32_t dirCluster);
+DirIndex *dirIndexGet(uint32_t dirCluster);
+DirIndex *dirIndexForCluster(uint32_t cluster);
+uint32_t dirIndexChainPosition(DirIndex *index, uint32_t cluster);
+bool dirIndexFreeSlot(DirIndex *index, uint32_t *cluster, uint32_t *slot);
+bool findFreeDirSlot(uint32_t dirCluster, uint32_t *cluster, uint32_t *slot);
+bool dirIndexFreeRun(DirIndex *index, uint32_t count, uint32_t *pos, uint32_t *slot);
+void dirIndexNoteSlotUsed(DirIndex *index, uint32_t pos, uint32_t slot, bool reused);
+void dirIndexNoteFreed(DirIndex *index, uint32_t pos, uint32_t slot);
+uint32_t longNameHash(const char *name);
+LongNameEntry *dirIndexFindLong(DirIndex *index, const char *name);
+bool dirIndexResizeLong(DirIndex *index, uint32_t capacity);
+bool dirIndexInsertLong(DirIndex *index, const char *name, const uint8_t *shortName);
+void dirIndexRemoveLong(DirIndex *index, const char *name);
+uint8_t lfnChecksum(const uint8_t *shortName);
+void lfnReset(LfnState *state);
+void lfnPlace(uint16_t *chars, const uint8_t *entry);
+void lfnAccept(LfnState *state, const uint8_t *entry);
+bool lfnFinish(LfnState *state, const uint8_t *shortName, char *out, size_t size);
+void lfnDecode(const uint16_t *chars, uint32_t count, char *out, size_t size);
+int lfnEncode(const char *name, uint16_t *chars);
+void lfnFillEntry(uint8_t *entry, const uint16_t *chars, int length, uint8_t ordinal, bool last, uint8_t checksum);
+bool isShortName(const char *name);
+bool isValidLongName(const char *name);
+char shortAliasChar(unsigned char c);
+bool makeShortAlias(uint32_t dirCluster, const char *longName, uint8_t *alias);
+bool resolveShortName(uint32_t dirCluster, const char *name, uint8_t *fatName);
+bool scanLongName(uint32_t dirCluster, const char *name, uint8_t *fatName);
+int writeLongDirectoryEntry(uint32_t parentCluster, const char *name, uint32_t cluster, uint8_t attr);
+void deleteLongNameEntries(uint32_t dirCluster, uint32_t entryCluster, uint32_t slot);
+void dirIndexNoteAdd(uint32_t cluster, uint32_t slot, const uint8_t *name, bool reused);
+void dirIndexNoteRemove(uint32_t cluster, const uint8_t *name);
+void dirIndexNoteGrow(uint32_t lastCluster, uint32_t newCluster);
+void dirIndexInvalidate(uint32_t dirCluster);
+void dirIndexReset();
+uint32_t parentDirectory(uint32_t dirCluster);
+uint32_t lookupDirectory(uint32_t dirCluster, const char *name);
+int resolvePath(const char *path, uint32_t *dirCluster, char *leaf);
+uint32_t resolveDirectory(const char *path);
+int changeDirectory(const char *path);
 void processCommand(tokenlist *tokens);
+void dispatchCommand(tokenlist *tokens);
 uint32_t allocateCluster();
+uint32_t allocateClusterBatch(uint32_t count, uint32_t *clusters);
 int initDirectoryCluster(uint32_t newCluster, uint32_t parentCluster);
 int updateParentDirectory(uint32_t parentCluster, const char *dirName, uint32_t newCluster);
 int createDirectory(const char *dirName);
+int makeDirectories(const char *path);
 void formatNameToFAT(const char *name, uint8_t *entryBuffer);
 int writeDirectoryEntry(uint32_t parentCluster, const char *name, uint32_t cluster, uint8_t attr);
 int writeEntryToDisk(uint32_t parentCluster, const uint8_t *entry);
@@ -87,6 +534,9 @@ bool isDirectoryFull(uint32_t parentCluster);
 int linkClusterToDirectory(uint32_t currentDirectoryCluster, uint32_t newCluster);
 int addDirectory(uint32_t parentCluster, const char *dirName);
 int createFile(const char *fileName);
+int compareBatchEntries(const void *a, const void *b);
+int createFiles(char **paths, int count);
+int createFilesFromManifest(const char *manifest);
 bool is_8_3_format_filename(const char *name);
 bool fileExists(const char *filename);
 void toUpperCase(char *str);
@@ -94,24 +544,54 @@ int expandDirectory(uint32_t parentCluster);
 void rightTrim(char *str);
 int openFile(const char *filename, const char *mode);
 void initOpenFiles();
+OpenFile *findOpenFile(const char *path);
 int closeFile(const char *filename);
 int writeToFile(const char *filename, const char *data);
 uint32_t findClusterByOffset(uint32_t startCluster, uint32_t offset);
 uint32_t getDirectoryEntryFileSize(uint32_t cluster);
 bool extendFile(uint32_t cluster, uint32_t newSize);
-void updateDirectoryEntrySize(uint32_t cluster, uint32_t newSize);
+void invalidateExtentMap(OpenFile *file);
+bool appendExtent(OpenFile *file, uint32_t diskCluster);
+bool extendExtentMap(OpenFile *file, uint32_t fromCluster);
+bool buildExtentMap(OpenFile *file);
+ClusterExtent *findExtent(OpenFile *file, uint32_t index);
+uint32_t mapFileCluster(OpenFile *file, uint32_t offset);
+bool extendOpenFile(OpenFile *file, uint32_t newSize);
+void updateDirectoryEntrySize(OpenFile *file, uint32_t newSize);
 const char *getString(const tokenlist *tokens);
-int seekFile(const char *filename, long offset);
+int seekFile(const char *filename, uint32_t offset);
 void listOpenFiles(void);
 int findFreeSessionId();
 bool isValidMode(const char *mode);
 bool isFileOpenForReading(const char *filename);
-int readFile(const char *filename, size_t size);
+void prefetchFileRange(OpenFile *file, uint32_t start, uint32_t end, bool fragmentsOnly);
+void readAhead(OpenFile *file, uint32_t fileSize);
+void adviseSequential(OpenFile *file, uint32_t offset, size_t length);
+long readFile(const char *filename, size_t size);
 dentry_t *getDentryB(const char *fileName, uint8_t *buffer);
 dentry_t *getDentry(const char *fileName);
 bool deleteFile(const char *fileName);
 bool fileIsOpen(const char *fileName);
+int compactDirectory(uint32_t dirCluster);
+int walkThreadCount();
+bool walkPush(TreeWalk *walk, WalkDeque *deque, char *path, uint32_t cluster, int depth);
+bool walkPop(WalkDeque *deque, WalkTask *task);
+bool walkSteal(WalkDeque *deque, WalkTask *task);
+bool walkRead(uint8_t *buffer, size_t length, off_t offset);
+bool walkAddRecord(WalkWorker *worker, char *path, uint32_t size, uint32_t clusters, uint8_t attr);
+uint32_t chainLength(uint32_t cluster);
+void walkDirectory(WalkWorker *worker, WalkTask *task);
+void *walkWorkerMain(void *arg);
+int walkTree(uint32_t dirCluster, const char *rootPath, WalkRecord **records, size_t *count);
+void freeWalkRecords(WalkRecord *records, size_t count);
+int compareWalkRecords(const void *a, const void *b);
+const char *walkRootPath(const char *path, char *rootPath);
+void findEntries(const char *pattern, const char *path);
+void diskUsage(const char *path);
+void printTree(const char *path);
+void maybeCompactDirectory(uint32_t dirCluster);
 void clearFATEntries(uint32_t cluster);
+void clearFATEntry(uint32_t cluster);
 int writeToFile(const char *filename, const char *data);
 
 #endif
\ No newline at end of file
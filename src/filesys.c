@@ -1,16 +1,21 @@
 #include "filesysFunc.h"
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <FAT32 image file>\n", argv[0]);
+    MountOptions options;
+    const char *imageName;
+    initMountOptions(&options);
+    if (parseMountOptions(argc - 1, argv + 1, &options, &imageName) != 0) {
+        fprintf(stderr, "Usage: %s [--cache-kb N] [--mmap] [--uring] [--direct] [--ramdisk] [--journal]\n"
+                        "       [--durability none|per-command|periodic] [--sync-ms N] [--check-mirrors]\n"
+                        "       <FAT32 image file>\n", argv[0]);
         return 1;
     }
 
-    if (mountImage(argv[1]) != 0) {
+    if (mountImage(imageName, &options) != 0) {
         return 1;
     }
     initDirStack();
-    pushDir(argv[1], 2);
+    pushDir(imageName, 2);
 
     char *input;
     while (1) {
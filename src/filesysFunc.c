@@ -1,10 +1,62 @@
 #include "filesysFunc.h"
 DirectoryStack dirStack;
+char *currentPath = NULL;        // Prompt path, grown to fit the directory stack
+size_t currentPathCapacity = 0;
 FAT32BootSector bs;
 uint32_t currentDirectoryCluster;
-int fd;
+BlockDevice *device = NULL; // Storage backend of the mounted image
 OpenFile openFiles[MAX_OPEN_FILES];
 
+uint32_t *fatTable = NULL; // In-memory copy of the FAT, loaded at mount
+bool fatMapped = false;    // fatTable points into imageMap instead of a private copy
+uint8_t *fatDirty = NULL;  // One flag per FAT sector changed since the last flush
+uint32_t fatEntryCount = 0;
+
+uint64_t *freeMap = NULL;         // Bit set = cluster is free
+uint32_t *freeChunkCount = NULL;  // Free clusters in each FREE_CHUNK_CLUSTERS-sized chunk
+uint32_t freeClusterTotal = 0;
+uint32_t clusterLimit = 0;        // One past the highest valid cluster number
+uint32_t nextFreeCursor = 2;      // Where the next allocation starts looking
+
+uint8_t fsInfoBuffer[512] __attribute__((aligned(IO_ALIGNMENT))); // Copy of the FSInfo sector, written back on sync
+bool fsInfoValid = false;
+bool fsInfoDirty = false;
+
+CacheEntry *cacheEntries = NULL; // Buffer cache slots, one cluster each
+uint8_t *cacheData = NULL;
+int32_t *cacheBuckets = NULL;    // Hash of cluster number to slot index
+uint32_t cacheCapacity = 0;
+uint32_t cacheBucketCount = 0;
+uint32_t cacheClockHand = 0;
+uint8_t *stagingBuffer = NULL;   // Reused by every large run read, aligned like the cache slots
+size_t ioAlignment = IO_ALIGNMENT; // Alignment of every I/O buffer, at least the device's O_DIRECT block size
+
+uint8_t *imageMap = NULL; // Whole image mapped MAP_SHARED by the mmap backend
+size_t imageMapSize = 0;
+
+DentryCacheEntry dentryCache[DENTRY_CACHE_SIZE]; // Recent (directory, name) lookups, hits and misses
+DirIndex dirIndexes[DIR_INDEX_SLOTS]; // Name indexes of recently searched directories
+uint64_t dirIndexClock = 0;
+uint32_t autoCompactPercent = 0; // Tombstone share that compacts a directory after rm, 0 disables
+
+int durabilityMode = DURABILITY_NONE;
+uint32_t syncIntervalMs = 0;
+pthread_mutex_t imageLock = PTHREAD_MUTEX_INITIALIZER; // Serialises commands against the flusher
+pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER;
+pthread_t flusherThread;
+bool flusherRunning = false;
+bool flusherStop = false;
+
+int journalFd = -1;           // Sidecar <image>.jnl, open while journaling is enabled
+off_t journalTail = 0;        // Where the next transaction is appended
+uint64_t journalSequence = 1; // Sequence number of the next transaction
+bool journalActive = false;   // Metadata reaches the image only through committed transactions
+
+#ifdef HAVE_IO_URING
+IoUring uring = {.ringFd = -1};
+#endif
+bool uringActive = false; // Batches go through io_uring instead of a pread/pwrite loop
+
 int sessionIdTracker[MAX_OPEN_FILES] = {0}; // Tracks whether a session ID is in use
 int highestSessionId = 0;
 extern int globalSessionId; //  global session ID tracker
@@ -77,1532 +129,5679 @@ void free_tokens(tokenlist *tokens)
     free(tokens);
 }
 
-int mountImage(const char *imageName)
+void initMountOptions(MountOptions *options)
+{
+    options->cacheBudget = CACHE_DEFAULT_BUDGET;
+    options->useMmap = false;
+    options->useUring = false;
+    options->useDirect = false;
+    options->useRamDisk = false;
+    options->useJournal = false;
+    options->checkMirrors = false;
+    options->durability = DURABILITY_NONE;
+    options->syncIntervalMs = SYNC_DEFAULT_INTERVAL_MS;
+}
+
+int parseMountOptions(int argc, char **argv, MountOptions *options, const char **imageName)
 {
-    fd = open(imageName, O_RDWR);
-    if (fd == -1)
+    *imageName = NULL;
+    for (int i = 0; i < argc; i++)
     {
-        perror("Error opening image file");
+        if (strcmp(argv[i], "--cache-kb") == 0 && i + 1 < argc)
+        {
+            options->cacheBudget = (size_t)strtoul(argv[++i], NULL, 10) * 1024;
+        }
+        else if (strcmp(argv[i], "--mmap") == 0)
+        {
+            options->useMmap = true;
+        }
+        else if (strcmp(argv[i], "--uring") == 0)
+        {
+            options->useUring = true;
+        }
+        else if (strcmp(argv[i], "--direct") == 0)
+        {
+            options->useDirect = true;
+        }
+        else if (strcmp(argv[i], "--ramdisk") == 0)
+        {
+            options->useRamDisk = true;
+        }
+        else if (strcmp(argv[i], "--journal") == 0)
+        {
+            options->useJournal = true;
+        }
+        else if (strcmp(argv[i], "--check-mirrors") == 0)
+        {
+            options->checkMirrors = true;
+        }
+        else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "none") == 0)
+                options->durability = DURABILITY_NONE;
+            else if (strcmp(argv[i], "per-command") == 0)
+                options->durability = DURABILITY_PER_COMMAND;
+            else if (strcmp(argv[i], "periodic") == 0)
+                options->durability = DURABILITY_PERIODIC;
+            else
+            {
+                printf("Unknown durability mode: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--sync-ms") == 0 && i + 1 < argc)
+        {
+            options->syncIntervalMs = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            printf("Unknown mount option: %s\n", argv[i]);
+            return -1;
+        }
+        else if (*imageName == NULL)
+        {
+            *imageName = argv[i];
+        }
+        else
+        {
+            return -1; // Only one image per mount
+        }
+    }
+    return *imageName ? 0 : -1;
+}
+
+int mountImage(const char *imageName, const MountOptions *options)
+{
+    if (device)
+    {
+        // Remounting: write back what the previous image still has pending
+        unmountImage();
+    }
+
+    device = openBlockDevice(imageName, options);
+    if (!device)
+        return -1;
+    if (device->zeroCopy)
+    {
+        imageMap = device->memory;
+        imageMapSize = device->size;
+    }
+    if (options->useUring)
+    {
+        if (device->read != fileDeviceRead)
+            printf("--uring only applies to the file backend, ignoring it.\n");
+        else if (uringInit(URING_ENTRIES) != 0)
+            printf("io_uring is not available, falling back to pread/pwrite.\n");
+    }
+    bool journal = options->useJournal;
+    if (journal && device->zeroCopy)
+    {
+        printf("--journal cannot order writes made through the mapping, ignoring it.\n");
+        journal = false;
+    }
+    // Replay whatever a previous session committed before anything reads the image
+    if (journalOpen(imageName, journal) != 0)
+    {
+        unmountImage();
         return -1;
     }
 
-    // Read from position 11 to get bytes per sector
-    pread(fd, &bs.bytesPerSector, sizeof(bs.bytesPerSector), 11);
-    // Read sectors per cluster from position 13
-    pread(fd, &bs.sectorsPerCluster, sizeof(bs.sectorsPerCluster), 13);
-    // Read number of reserved sectors from position 14
-    pread(fd, &bs.reservedSectors, sizeof(bs.reservedSectors), 14);
-    // Read number of FATs from position 16
-    pread(fd, &bs.numFATs, sizeof(bs.numFATs), 16);
-    // Read total sectors from position 32
-    pread(fd, &bs.totalSectors, sizeof(bs.totalSectors), 32);
-    // Read sectors per FAT from position 36
-    pread(fd, &bs.FATSize, sizeof(bs.FATSize), 36);
-    // Read root cluster from position 44
-    pread(fd, &bs.rootCluster, sizeof(bs.rootCluster), 44);
+    // Read the boot sector once into an aligned buffer, O_DIRECT rejects small unaligned reads
+    uint8_t *bootSector = alignedAlloc(IO_ALIGNMENT);
+    if (!bootSector || readImage(bootSector, IO_ALIGNMENT, 0) != 0)
+    {
+        printf("Failed to read boot sector.\n");
+        free(bootSector);
+        unmountImage();
+        return -1;
+    }
+    // Bytes per sector at position 11
+    memcpy(&bs.bytesPerSector, bootSector + 11, sizeof(bs.bytesPerSector));
+    // Sectors per cluster at position 13
+    memcpy(&bs.sectorsPerCluster, bootSector + 13, sizeof(bs.sectorsPerCluster));
+    // Number of reserved sectors at position 14
+    memcpy(&bs.reservedSectors, bootSector + 14, sizeof(bs.reservedSectors));
+    // Number of FATs at position 16
+    memcpy(&bs.numFATs, bootSector + 16, sizeof(bs.numFATs));
+    // Total sectors at position 32
+    memcpy(&bs.totalSectors, bootSector + 32, sizeof(bs.totalSectors));
+    // Sectors per FAT at position 36
+    memcpy(&bs.FATSize, bootSector + 36, sizeof(bs.FATSize));
+    // FAT mirroring flags at position 40
+    memcpy(&bs.extFlags, bootSector + 40, sizeof(bs.extFlags));
+    // Root cluster at position 44
+    memcpy(&bs.rootCluster, bootSector + 44, sizeof(bs.rootCluster));
+    // FSInfo sector number at position 48
+    memcpy(&bs.fsInfoSector, bootSector + 48, sizeof(bs.fsInfoSector));
+    free(bootSector);
 
     // Calculate the first data sector
     bs.firstDataSector = bs.reservedSectors + (bs.numFATs * bs.FATSize);
     currentDirectoryCluster = bs.rootCluster;
 
+    if (loadFAT(options->checkMirrors) != 0 || cacheInit(options->cacheBudget) != 0)
+    {
+        unmountImage();
+        return -1;
+    }
+    readFSInfo();
+
+    durabilityMode = options->durability;
+    syncIntervalMs = options->syncIntervalMs ? options->syncIntervalMs : SYNC_DEFAULT_INTERVAL_MS;
+    if (durabilityMode == DURABILITY_PERIODIC && startFlusher() != 0)
+    {
+        printf("Failed to start the flusher thread, syncing after every command instead.\n");
+        durabilityMode = DURABILITY_PER_COMMAND;
+    }
     return 0;
 }
 
-void printInfo()
+void unmountImage()
 {
-    uint32_t totalDataSectors = bs.totalSectors - (bs.reservedSectors + (bs.FATSize * bs.numFATs * bs.sectorsPerCluster));
-    uint64_t totalClusters = totalDataSectors / bs.sectorsPerCluster;
-    printf("Bytes Per Sector: %d\n", bs.bytesPerSector);
-    printf("Sectors Per Cluster: %d\n", bs.sectorsPerCluster);
-    printf("Root Cluster: %d\n", bs.rootCluster);
-    printf("Total # of Clusters in Data Region: %lu\n", totalClusters);
-    printf("# of Entries in One FAT: %d\n", bs.FATSize * (bs.bytesPerSector / 4)); // Assuming 4 bytes per FAT entry
-    printf("Size of Image (in bytes): %lu\n", (uint64_t)bs.totalSectors * bs.bytesPerSector);
+    stopFlusher();
+    syncImage();
+    journalCheckpoint();
+    journalClose();
+    dirIndexReset();
+    dentryCacheReset();
+    cacheDestroy();
+    freeFAT();
+    uringExit();
+    fsInfoValid = false;
+    imageMap = NULL;
+    imageMapSize = 0;
+    device->close(device);
+    device = NULL;
 }
 
-uint32_t clusterToSector(uint32_t cluster)
+void *flusherMain(void *arg)
 {
-    // The cluster number should be at least 2, as cluster numbers start from 2 in FAT32.
-    if (cluster < 2)
+    (void)arg;
+    pthread_mutex_lock(&imageLock);
+    while (!flusherStop)
     {
-        fprintf(stderr, "Invalid cluster number: %u. Cluster numbers should be >= 2.\n", cluster);
-        return 0; 
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += syncIntervalMs / 1000;
+        deadline.tv_nsec += (long)(syncIntervalMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        // Waiting releases the lock, so commands run freely between flushes
+        pthread_cond_timedwait(&flusherWake, &imageLock, &deadline);
+        if (!flusherStop && device)
+            syncImage();
     }
-    // Calculate the sector number corresponding to the given cluster number.
-    uint32_t sector = ((cluster - 2) * bs.sectorsPerCluster) + bs.firstDataSector;
-    return sector;
+    pthread_mutex_unlock(&imageLock);
+    return NULL;
 }
 
-void readCluster(uint32_t clusterNumber, uint8_t *buffer)
+int startFlusher()
 {
-    uint32_t firstSector = clusterToSector(clusterNumber);
-    ssize_t bytesRead = pread(fd, buffer, bs.bytesPerSector * bs.sectorsPerCluster, firstSector * bs.bytesPerSector);
-    if (bytesRead < bs.bytesPerSector * bs.sectorsPerCluster)
-    {
-        perror("Failed to read full cluster");
-    }
+    flusherStop = false;
+    if (pthread_create(&flusherThread, NULL, flusherMain, NULL) != 0)
+        return -1;
+    flusherRunning = true;
+    return 0;
 }
 
-uint32_t readFATEntry(uint32_t clusterNumber)
+void stopFlusher()
 {
-    uint32_t fatOffset = clusterNumber * 4; 
-    uint32_t fatSector = bs.reservedSectors + (fatOffset / bs.bytesPerSector);
-    uint32_t entOffset = fatOffset % bs.bytesPerSector;
-    uint8_t sectorBuffer[512];                                  
-    pread(fd, sectorBuffer, 512, fatSector * bs.bytesPerSector); // Read the sector containing the FAT entry
-    uint32_t nextCluster;
-    memcpy(&nextCluster, &sectorBuffer[entOffset], sizeof(uint32_t));
-    nextCluster &= 0x0FFFFFFF; // Mask to get 28 bits
-    return nextCluster;
+    if (!flusherRunning)
+        return;
+    // The caller holds imageLock; let go of it so the flusher can see the stop flag and exit
+    flusherStop = true;
+    pthread_cond_signal(&flusherWake);
+    pthread_mutex_unlock(&imageLock);
+    pthread_join(flusherThread, NULL);
+    pthread_mutex_lock(&imageLock);
+    flusherRunning = false;
 }
 
-uint32_t findDirectoryCluster(const char *dirName)
+void *alignedAlloc(size_t size)
 {
-    uint8_t *buffer = malloc(bs.bytesPerSector * bs.sectorsPerCluster);
-    if (!buffer)
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, ioAlignment, size) != 0)
+        return NULL;
+    return buffer;
+}
+
+BlockDevice *openBlockDevice(const char *imageName, const MountOptions *options)
+{
+    if (options->useRamDisk)
     {
-        printf("Memory allocation failed\n");
-        return 0;
+        if (options->useMmap || options->useDirect)
+            printf("--ramdisk keeps the whole image in memory, ignoring --mmap and --direct.\n");
+        return openRamDevice(imageName);
+    }
+    if (options->useDirect)
+    {
+        if (options->useMmap)
+            printf("--direct bypasses the page cache that --mmap relies on, ignoring --mmap.\n");
+        return openFileDevice(imageName, true);
     }
+    if (options->useMmap)
+        return openMmapDevice(imageName);
+    return openFileDevice(imageName, false);
+}
 
-    printf("Searching for directory: %s\n", dirName);
-    if (strcmp(dirName, "..") == 0)
+BlockDevice *newBlockDevice(int imageFd)
+{
+    BlockDevice *created = calloc(1, sizeof(BlockDevice));
+    if (!created)
     {
-        if (dirStack.size == 1)
-        {
-            printf("Already at root directory\n");
-            free(buffer);
-            return 2;
-        }
-        popDir();
-        uint32_t parent = dirStack.clusterNumber[dirStack.size - 1];
-        printf("Parent directory cluster: %d\n", parent);
-        free(buffer);
-        return parent;
+        printf("Failed to allocate the block device.\n");
+        close(imageFd);
+        return NULL;
     }
-    if (strcmp(dirName, ".") == 0)
+    created->fd = imageFd;
+    created->alignment = 1;
+    return created;
+}
+
+BlockDevice *openFileDevice(const char *imageName, bool direct)
+{
+    int imageFd = open(imageName, direct ? O_RDWR | O_DIRECT : O_RDWR);
+    if (imageFd == -1 && direct && errno == EINVAL)
     {
-        free(buffer);
-        return currentDirectoryCluster;
+        printf("O_DIRECT is not supported for this image, falling back to buffered I/O.\n");
+        imageFd = open(imageName, O_RDWR);
     }
-    char dirNameUpper[12]; 
-    strncpy(dirNameUpper, dirName, 11);
-    dirNameUpper[11] = '\0'; 
-    // Convert dirNameUpper to uppercase
-    for (int i = 0; dirNameUpper[i]; i++)
+    if (imageFd == -1)
     {
-        dirNameUpper[i] = toupper(dirNameUpper[i]);
+        perror("Error opening image file");
+        return NULL;
     }
-    uint32_t cluster = currentDirectoryCluster;
-    do
+    BlockDevice *created = newBlockDevice(imageFd);
+    if (!created)
+        return NULL;
+    if (direct && (fcntl(imageFd, F_GETFL) & O_DIRECT))
     {
-        readCluster(cluster, buffer);
-        dentry_t *dentry = (dentry_t *)buffer;
-        for (int i = 0; i < bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t); i++, dentry++)
-        {
-            if (dentry->DIR_Name[0] == 0)
-                break; 
-            if (dentry->DIR_Name[0] == 0xE5)
-                continue; // Skip deleted entry
+        created->alignment = directAlignment(imageFd);
+        if (created->alignment > ioAlignment)
+            ioAlignment = created->alignment;
+    }
+    created->read = fileDeviceRead;
+    created->write = fileDeviceWrite;
+    created->flush = fileDeviceFlush;
+    created->close = fileDeviceClose;
+    return created;
+}
 
-            char name[12];
-            memset(name, ' ', 11); 
-            memcpy(name, dentry->DIR_Name, 11);
-            name[11] = '\0';
-            for (int j = 0; j < 11; j++)
-            {
-                if (name[j] == ' ')
-                    name[j] = '\0'; // Stop at the first space
-                else
-                    name[j] = toupper(name[j]);
-            }
-            if (strcmp(name, dirNameUpper) == 0)
-            {
-                free(buffer);
-                uint32_t clusterNumber = ((uint32_t)dentry->DIR_FstClusHI << 16) | dentry->DIR_FstClusLO;
-                printf("Found directory %s at cluster %u\n", dirName, clusterNumber);
-                return clusterNumber;
-            }
-        }
-        cluster = readFATEntry(cluster);
-    } while (cluster < 0x0FFFFFF8);
-    free(buffer);
-    return 0;
+size_t directAlignment(int fd)
+{
+    // O_DIRECT works in logical blocks of the device: 512 bytes on most disks, 4 KiB on 4Kn ones
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return IO_ALIGNMENT;
+    size_t alignment = st.st_blksize;
+    int blockSize;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &blockSize) == 0)
+        alignment = blockSize;
+    if (alignment < 512 || (alignment & (alignment - 1)) != 0)
+        return IO_ALIGNMENT;
+    return alignment;
 }
 
-void dbg_print_dentry(dentry_t *dentry)
+bool transferAligned(const BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset)
 {
-    if (dentry == NULL)
+    size_t mask = dev->alignment - 1;
+    if ((size_t)offset & mask)
+        return false;
+    for (int i = 0; i < iovCount; i++)
     {
-        return;
+        if (((uintptr_t)iov[i].iov_base & mask) || (iov[i].iov_len & mask))
+            return false;
     }
-    printf("DIR_Name: %s\n", dentry->DIR_Name);
-    printf("DIR_Attr: 0x%x\n", dentry->DIR_Attr);
-    printf("DIR_FstClusHI: 0x%x\n", dentry->DIR_FstClusHI);
-    printf("DIR_FstClusLO: 0x%x\n", dentry->DIR_FstClusLO);
-    printf("DIR_FileSize: %u\n", dentry->DIR_FileSize);
+    return true;
 }
-void listDirectory(uint32_t cluster)
+
+ssize_t bounceTransfer(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset, bool write)
 {
-    uint8_t *buffer = malloc(bs.bytesPerSector * bs.sectorsPerCluster);
-    if (!buffer)
+    // Widen the range to whole device blocks and move it through an aligned buffer
+    size_t length = 0;
+    for (int i = 0; i < iovCount; i++)
     {
-        printf("Failed to allocate memory for directory listing.\n");
-        return;
+        length += iov[i].iov_len;
     }
-    printf("Listing directory at cluster: %d\n", cluster);
-
-    while (cluster < 0x0FFFFFF8)
-    { 
-        readCluster(cluster, buffer);
-        dentry_t *entry = (dentry_t *)buffer;
-        int entryFound = 0;
+    off_t start = offset & ~(off_t)(dev->alignment - 1);
+    size_t head = offset - start;
+    size_t span = (head + length + dev->alignment - 1) & ~(dev->alignment - 1);
+    uint8_t *bounce = alignedAlloc(span);
+    if (!bounce)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(bounce, 0, span);
 
-        for (int i = 0; i < (bs.bytesPerSector * bs.sectorsPerCluster) / sizeof(dentry_t); i++, entry++)
+    ssize_t n;
+    if (write)
+    {
+        // The blocks at either edge keep whatever else they hold
+        if (head != 0 && pread(dev->fd, bounce, dev->alignment, start) < 0)
         {
-            if (entry->DIR_Name[0] == 0)
-                break; // No more entries
-            if (entry->DIR_Name[0] == 0xE5)
-                continue; // Entry is deleted
-            if ((entry->DIR_Attr & 0x0F) == 0x0F)
-                continue; // Skip lon names
-
-            char name[12];
-            memcpy(name, entry->DIR_Name, 11);
-            name[11] = '\0'; 
-            printf("%s", name);
-            entryFound = 1;
+            free(bounce);
+            return -1;
         }
-
-        if (!entryFound)
+        bool tailShared = (head + length) % dev->alignment != 0;
+        if (tailShared && (head == 0 || span > dev->alignment) &&
+            pread(dev->fd, bounce + span - dev->alignment, dev->alignment, start + span - dev->alignment) < 0)
         {
-            printf("No valid entries found in current directory cluster: %d\n", cluster);
+            free(bounce);
+            return -1;
         }
-        else
+        size_t at = head;
+        for (int i = 0; i < iovCount; i++)
         {
-            printf("\n");
+            memcpy(bounce + at, iov[i].iov_base, iov[i].iov_len);
+            at += iov[i].iov_len;
+        }
+        n = pwrite(dev->fd, bounce, span, start);
+    }
+    else
+    {
+        n = pread(dev->fd, bounce, span, start);
+        size_t at = head;
+        for (int i = 0; n > 0 && i < iovCount && at < (size_t)n; i++)
+        {
+            size_t piece = (size_t)n - at < iov[i].iov_len ? (size_t)n - at : iov[i].iov_len;
+            memcpy(iov[i].iov_base, bounce + at, piece);
+            at += piece;
         }
-
-        cluster = readFATEntry(cluster);
     }
+    free(bounce);
+    if (n < 0)
+        return -1;
+    // Report only the caller's bytes, a short transfer may end inside the head
+    if ((size_t)n <= head)
+        return 0;
+    return (size_t)n - head < length ? (ssize_t)((size_t)n - head) : (ssize_t)length;
+}
 
-    free(buffer);
+ssize_t fileDeviceRead(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset)
+{
+    if (dev->alignment > 1 && !transferAligned(dev, iov, iovCount, offset))
+        return bounceTransfer(dev, iov, iovCount, offset, false);
+    return preadv(dev->fd, iov, iovCount, offset);
 }
 
-int createDirEntry(uint32_t parentCluster, const char *dirName)
+ssize_t fileDeviceWrite(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset)
 {
-    uint32_t dirCluster = allocateCluster();
-    if (dirCluster == 0)
-    {
-        printf("Failed to allocate a new cluster for the directory.\n");
-        return -1;
-    }
-    if (!writeDirectoryEntry(parentCluster, dirName, dirCluster, ATTR_DIRECTORY))
+    if (dev->alignment > 1 && !transferAligned(dev, iov, iovCount, offset))
+        return bounceTransfer(dev, iov, iovCount, offset, true);
+    return pwritev(dev->fd, iov, iovCount, offset);
+}
+
+int fileDeviceFlush(BlockDevice *dev)
+{
+    if (fdatasync(dev->fd) != 0)
     {
-        printf("Failed to create directory entry.\n");
+        perror("Failed to sync image");
         return -1;
     }
-    // Create entries for '.' and '..'
-    writeDirectoryEntry(dirCluster, ".", dirCluster, ATTR_DIRECTORY);    
-    writeDirectoryEntry(dirCluster, "..", parentCluster, ATTR_DIRECTORY); 
-    return 0;                                                            
+    dev->unsynced = false;
+    return 0;
 }
 
-void formatNameToFAT(const char *name, uint8_t *entryBuffer)
+void fileDeviceClose(BlockDevice *dev)
 {
-    memset(entryBuffer, ' ', 11);
-    // Copy the base name and extension into the buffer
-    int i = 0, j = 0;
-    for (; name[i] != '\0' && name[i] != '.' && i < 8; ++i)
+    close(dev->fd);
+    free(dev);
+}
+
+BlockDevice *openMmapDevice(const char *imageName)
+{
+    int imageFd = open(imageName, O_RDWR);
+    if (imageFd == -1)
     {
-        entryBuffer[j++] = toupper((unsigned char)name[i]); //  only the first 8 characters(name) 
+        perror("Error opening image file");
+        return NULL;
     }
-    if (name[i] == '.')
-        ++i; 
-    j = 8;  
-    for (; name[i] != '\0' && j < 11; ++i)
+    struct stat st;
+    if (fstat(imageFd, &st) != 0)
     {
-        entryBuffer[j++] = toupper((unsigned char)name[i]); 
+        perror("Failed to stat image");
+        close(imageFd);
+        return NULL;
     }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, imageFd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map image");
+        close(imageFd);
+        return NULL;
+    }
+    BlockDevice *created = newBlockDevice(imageFd);
+    if (!created)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    created->memory = map;
+    created->size = st.st_size;
+    created->zeroCopy = true; // Callers may work on the mapping directly
+    created->read = memoryDeviceRead;
+    created->write = memoryDeviceWrite;
+    created->flush = mmapDeviceFlush;
+    created->close = mmapDeviceClose;
+    return created;
 }
 
-int updateParentDirectory(uint32_t parentCluster, const char *dirName, uint32_t newCluster)
+ssize_t memoryDeviceTransfer(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset, bool write)
 {
-    if (writeDirectoryEntry(parentCluster, dirName, newCluster, ATTR_DIRECTORY) != 0)
+    if (offset < 0 || (size_t)offset >= dev->size)
+        return 0; // Past the end of the image, like a read at EOF
+    size_t position = offset;
+    for (int i = 0; i < iovCount && position < dev->size; i++)
     {
-        printf("Failed to update parent directory with new directory entry.\n");
-        return -1;
+        size_t length = iov[i].iov_len;
+        if (length > dev->size - position)
+            length = dev->size - position;
+        if (write)
+            memcpy(dev->memory + position, iov[i].iov_base, length);
+        else
+            memcpy(iov[i].iov_base, dev->memory + position, length);
+        position += length;
     }
-    return 0;
+    return position - offset;
 }
 
-void writeFATEntry(uint32_t clusterNumber, uint32_t value)
+ssize_t memoryDeviceRead(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset)
 {
-    uint32_t fatOffset = clusterNumber * 4;
-    uint32_t fatSector = bs.reservedSectors + (fatOffset / bs.bytesPerSector);
-    uint32_t entOffset = fatOffset % bs.bytesPerSector;
-    uint8_t sectorBuffer[bs.bytesPerSector];
-    pread(fd, sectorBuffer, bs.bytesPerSector, fatSector * bs.bytesPerSector); 
-    memcpy(&sectorBuffer[entOffset], &value, sizeof(uint32_t));
-    pwrite(fd, sectorBuffer, bs.bytesPerSector, fatSector * bs.bytesPerSector); // Write back the modified sector
+    return memoryDeviceTransfer(dev, iov, iovCount, offset, false);
 }
 
-int writeEntryToDisk(uint32_t parentCluster, const uint8_t *entry)
+ssize_t memoryDeviceWrite(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset)
 {
-    uint32_t sectorNumber = clusterToSector(parentCluster);
-    int found = 0;
-    // Calculate the full sector size to be read/written.
-    uint32_t sectorSize = bs.bytesPerSector;
-    uint32_t clusterSize = bs.sectorsPerCluster * sectorSize;
-    char buffer[clusterSize];
+    return memoryDeviceTransfer(dev, iov, iovCount, offset, true);
+}
 
-    if (pread(fd, buffer, clusterSize, sectorNumber * sectorSize) != clusterSize)
+int mmapDeviceFlush(BlockDevice *dev)
+{
+    if (msync(dev->memory, dev->size, MS_SYNC) != 0)
     {
-        perror("Error reading sector");
+        perror("Failed to sync mapped image");
         return -1;
     }
-    // Iterate over each entry within the cluster to find a free or deleted entry.
-    for (int i = 0; i < clusterSize; i += ENTRY_SIZE)
+    dev->unsynced = false;
+    return 0;
+}
+
+void mmapDeviceClose(BlockDevice *dev)
+{
+    munmap(dev->memory, dev->size);
+    close(dev->fd);
+    free(dev);
+}
+
+BlockDevice *openRamDevice(const char *imageName)
+{
+    int imageFd = open(imageName, O_RDWR);
+    if (imageFd == -1)
     {
-        if (buffer[i] == 0x00 || buffer[i] == 0xE5)
-        {                                          
-            memcpy(&buffer[i], entry, ENTRY_SIZE);
-            found = 1;
-            break;
-        }
+        perror("Error opening image file");
+        return NULL;
     }
-    // If a free entry was found, write cluster back to disk
-    if (found)
+    BlockDevice *created = newBlockDevice(imageFd);
+    if (!created)
+        return NULL;
+    struct stat st;
+    if (fstat(imageFd, &st) != 0)
     {
-        if (pwrite(fd, buffer, clusterSize, sectorNumber * sectorSize) != clusterSize)
-        {
-            perror("Error writing sector");
-            return -1;
-        }
-        return 0;
+        perror("Failed to stat image");
+        ramDeviceClose(created);
+        return NULL;
     }
-    else
+    created->size = st.st_size;
+    created->memory = alignedAlloc(created->size);
+    created->dirtyChunks = calloc(created->size / RAMDISK_CHUNK_SIZE + 1, 1);
+    if (!created->memory || !created->dirtyChunks)
     {
-        printf("Failed to find a free directory entry.\n");
-        return -1;
+        printf("Not enough memory to load the image into RAM.\n");
+        ramDeviceClose(created);
+        return NULL;
     }
-}
 
-uint32_t allocateCluster()
-{
-    uint32_t clusterNumber, nextCluster;
-    for (clusterNumber = 2; clusterNumber < bs.totalSectors / bs.sectorsPerCluster; clusterNumber++)
+    // Load the whole image up front; from here on only flush touches the file
+    size_t done = 0;
+    while (done < created->size)
     {
-        nextCluster = readFATEntry(clusterNumber);
-        if (nextCluster == 0)
-        { 
-            writeFATEntry(clusterNumber, 0x0FFFFFFF);
-            return clusterNumber;
+        ssize_t n = pread(imageFd, created->memory + done, created->size - done, done);
+        if (n <= 0)
+        {
+            perror("Failed to load image");
+            ramDeviceClose(created);
+            return NULL;
         }
+        done += n;
     }
-    return 0;
+    created->read = memoryDeviceRead;
+    created->write = ramDeviceWrite;
+    created->flush = ramDeviceFlush;
+    created->close = ramDeviceClose;
+    return created;
 }
 
-int writeDirectoryEntry(uint32_t parentCluster, const char *name, uint32_t cluster, uint8_t attr)
+ssize_t ramDeviceWrite(BlockDevice *dev, const struct iovec *iov, int iovCount, off_t offset)
 {
-    while (true)
+    ssize_t written = memoryDeviceTransfer(dev, iov, iovCount, offset, true);
+    for (size_t chunk = offset / RAMDISK_CHUNK_SIZE; written > 0 && chunk <= (offset + written - 1) / RAMDISK_CHUNK_SIZE; chunk++)
     {
-        uint32_t sectorNumber = clusterToSector(parentCluster);
-        uint32_t clusterSize = bs.sectorsPerCluster * bs.bytesPerSector;
-        uint8_t buffer[clusterSize];
+        dev->dirtyChunks[chunk] = 1;
+    }
+    return written;
+}
 
-        if (pread(fd, buffer, clusterSize, sectorNumber * bs.bytesPerSector) < clusterSize)
+int ramDeviceFlush(BlockDevice *dev)
+{
+    size_t chunkCount = dev->size / RAMDISK_CHUNK_SIZE + 1;
+    size_t chunk = 0;
+    while (chunk < chunkCount)
+    {
+        if (!dev->dirtyChunks[chunk])
         {
-            perror("Error reading cluster");
-            return -1;
+            chunk++;
+            continue;
         }
-
-        for (int i = 0; i < clusterSize; i += ENTRY_SIZE)
+        // Persist each run of dirty chunks with one write
+        size_t runStart = chunk;
+        while (chunk < chunkCount && dev->dirtyChunks[chunk])
+            chunk++;
+        size_t start = runStart * RAMDISK_CHUNK_SIZE;
+        size_t end = chunk * RAMDISK_CHUNK_SIZE < dev->size ? chunk * RAMDISK_CHUNK_SIZE : dev->size;
+        while (start < end)
         {
-            // Check for free (0x00) or deleted (0xE5) entries
-            if (buffer[i] == 0x00 || buffer[i] == 0xE5)
+            ssize_t n = pwrite(dev->fd, dev->memory + start, end - start, start);
+            if (n <= 0)
             {
-                // Properly format the filename and extension into the buffer
-                formatNameToFAT(name, buffer + i);
-                buffer[i + 11] = attr;                  
-                uint16_t hi = (cluster >> 16) & 0xFFFF; 
-                uint16_t lo = cluster & 0xFFFF;        
-                memcpy(buffer + i + 20, &hi, sizeof(hi));
-                memcpy(buffer + i + 26, &lo, sizeof(lo));
-                memset(buffer + i + 28, 0, 4); // Set file size to 0 bytes -req
-
-                if (pwrite(fd, buffer, clusterSize, sectorNumber * bs.bytesPerSector) < clusterSize)
-                {
-                    perror("Failed to write directory entry");
-                    return -1;
-                }
-                return 0;
+                perror("Failed to persist RAM disk");
+                return -1;
             }
+            start += n;
         }
-
-        // No free entry found, try to expand the directory
-        int newCluster = expandDirectory(parentCluster);
-        if (newCluster == -1)
-        {
-            return -1;
-        }
-        parentCluster = newCluster; 
+        memset(dev->dirtyChunks + runStart, 0, chunk - runStart);
     }
+    return fileDeviceFlush(dev);
 }
 
-int createDirectory(const char *dirName)
+void ramDeviceClose(BlockDevice *dev)
 {
-    printf("Attempting to create directory: %s\n", dirName);
+    free(dev->memory);
+    free(dev->dirtyChunks);
+    close(dev->fd);
+    free(dev);
+}
 
- 
-    if (!is_8_3_format_directory(dirName))
+int readImage(void *buffer, size_t length, off_t offset)
+{
+    IoRequest request = {0};
+    request.buffer = buffer;
+    request.length = length;
+    request.offset = offset;
+    return ioTransfer(&request);
+}
+
+int writeImage(const void *buffer, size_t length, off_t offset)
+{
+    IoRequest request = {0};
+    request.buffer = (void *)buffer;
+    request.length = length;
+    request.offset = offset;
+    request.write = true;
+    return ioTransfer(&request);
+}
+
+int ioTransfer(IoRequest *request)
+{
+    // Work on a copy of the vector so a short transfer can advance past what already moved
+    struct iovec iov[IO_MAX_IOV];
+    int count = 1;
+    if (request->iovCount > 0)
     {
-        printf("Error: Directory name '%s' is not in FAT32 8.3 format.\n", dirName);
-        return -1;
+        count = request->iovCount;
+        memcpy(iov, request->iov, count * sizeof(struct iovec));
     }
-
-    uint32_t existingCluster = findDirectoryCluster(dirName);
-    if (existingCluster != 0)
+    else
     {
-        printf("Error: Directory '%s' already exists at cluster %u.\n", dirName, existingCluster);
-        return -1;
+        iov[0].iov_base = request->buffer;
+        iov[0].iov_len = request->length;
     }
-    if (isDirectoryFull(currentDirectoryCluster))
+
+    int first = 0;
+    size_t done = 0;
+    while (true)
     {
-        uint32_t newCluster = allocateCluster();
-        if (newCluster == 0)
+        while (first < count && iov[first].iov_len == 0)
+            first++;
+        if (first == count)
+            break;
+        ssize_t n = request->write
+                        ? device->write(device, iov + first, count - first, request->offset + done)
+                        : device->read(device, iov + first, count - first, request->offset + done);
+        if (n <= 0)
         {
-            printf("Error: No free clusters available to extend the directory.\n");
+            perror(request->write ? "Failed to write image" : "Failed to read image");
+            request->result = -1;
             return -1;
         }
-
-        // Link the new cluster as part of the current directory to extend its capacity
-        if (linkClusterToDirectory(currentDirectoryCluster, newCluster) != 0)
+        done += n;
+        while (n > 0)
         {
-            printf("Error: Failed to link new cluster to extend directory capacity.\n");
-            return -1;
+            if ((size_t)n >= iov[first].iov_len)
+            {
+                n -= iov[first].iov_len;
+                iov[first++].iov_len = 0;
+            }
+            else
+            {
+                iov[first].iov_base = (uint8_t *)iov[first].iov_base + n;
+                iov[first].iov_len -= n;
+                n = 0;
+            }
         }
-        return addDirectory(newCluster, dirName);
     }
+    if (request->write)
+        device->unsynced = true;
+    request->result = 0;
+    return 0;
+}
 
-    // Add the directory to the current directory cluster
-    return addDirectory(currentDirectoryCluster, dirName);
+bool ioRequestAligned(const IoRequest *request)
+{
+    if (request->iovCount > 0)
+        return transferAligned(device, request->iov, request->iovCount, request->offset);
+    struct iovec iov = {request->buffer, request->length};
+    return transferAligned(device, &iov, 1, request->offset);
 }
 
-int initDirectoryCluster(uint32_t newCluster, uint32_t parentCluster)
+int submitIoBatch(IoRequest *requests, int count)
 {
-    clearCluster(newCluster);
-    // Create '.' and '..' directory entries
-    if (writeDirectoryEntry(newCluster, ".", newCluster, ATTR_DIRECTORY) != 0 ||
-        writeDirectoryEntry(newCluster, "..", parentCluster, ATTR_DIRECTORY) != 0)
+#ifdef HAVE_IO_URING
+    // The ring hands requests to the kernel as they are, only the pread path widens
+    // transfers that do not fit the device's O_DIRECT blocks
+    bool aligned = true;
+    for (int i = 0; uringActive && device->alignment > 1 && aligned && i < count; i++)
     {
-        printf("Failed to write '.' or '..' directory entries.\n");
-        return -1;
+        aligned = ioRequestAligned(&requests[i]);
     }
-    return 0;
+    if (uringActive && aligned)
+        return uringSubmitBatch(requests, count);
+#endif
+    int status = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (ioTransfer(&requests[i]) != 0)
+            status = -1;
+    }
+    return status;
 }
 
-void clearCluster(uint32_t clusterNumber)
+#ifdef HAVE_IO_URING
+int uringInit(unsigned entries)
 {
-    uint32_t sector = clusterToSector(clusterNumber);
-    uint8_t buffer[bs.bytesPerSector * bs.sectorsPerCluster];
-    memset(buffer, 0, sizeof(buffer));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0)
+        return -1;
 
-    for (int i = 0; i < bs.sectorsPerCluster; i++)
+    uring.ringFd = ringFd;
+    uring.entries = params.sq_entries;
+    uring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap && uring.cqRingSize > uring.sqRingSize)
+        uring.sqRingSize = uring.cqRingSize;
+
+    uring.sqRing = mmap(NULL, uring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    uring.cqRing = singleMap ? uring.sqRing
+                             : mmap(NULL, uring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    uring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (uring.sqRing == MAP_FAILED || uring.cqRing == MAP_FAILED || uring.sqes == MAP_FAILED)
     {
-        if (pwrite(fd, buffer, bs.bytesPerSector, (sector + i) * bs.bytesPerSector) != bs.bytesPerSector)
-        {
-            perror("Failed to clear cluster");
-            break;
-        }
+        perror("Failed to map io_uring");
+        uringExit();
+        return -1;
     }
+
+    uint8_t *sq = uring.sqRing;
+    uint8_t *cq = uring.cqRing;
+    uring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sqArray = (unsigned *)(sq + params.sq_off.array);
+    uring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    uring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    uringActive = true;
+    return 0;
 }
 
-bool isDirectoryFull(uint32_t parentCluster)
+void uringExit()
 {
-    do
+    if (uring.ringFd == -1)
+        return;
+    if (uring.sqes && uring.sqes != MAP_FAILED)
+        munmap(uring.sqes, uring.sqesSize);
+    if (uring.cqRing && uring.cqRing != MAP_FAILED && uring.cqRing != uring.sqRing)
+        munmap(uring.cqRing, uring.cqRingSize);
+    if (uring.sqRing && uring.sqRing != MAP_FAILED)
+        munmap(uring.sqRing, uring.sqRingSize);
+    close(uring.ringFd);
+    memset(&uring, 0, sizeof(uring));
+    uring.ringFd = -1;
+    uringActive = false;
+}
+
+int uringSubmitBatch(IoRequest *requests, int count)
+{
+    int status = 0;
+    int done = 0;
+    while (done < count)
     {
-        uint32_t sectorNumber = clusterToSector(parentCluster);
-        uint32_t clusterSize = bs.sectorsPerCluster * bs.bytesPerSector;
-        uint8_t buffer[clusterSize];
+        unsigned batch = (unsigned)(count - done) < uring.entries ? (unsigned)(count - done) : uring.entries;
 
-        if (pread(fd, buffer, clusterSize, sectorNumber * bs.bytesPerSector) != clusterSize)
+        // Queue the whole batch; only this thread ever moves the SQ tail
+        unsigned tail = *uring.sqTail;
+        for (unsigned i = 0; i < batch; i++, tail++)
         {
-            perror("Error reading cluster for full check");
-            return true;
+            IoRequest *request = &requests[done + i];
+            unsigned index = tail & *uring.sqMask;
+            struct io_uring_sqe *sqe = &uring.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->fd = device->fd;
+            sqe->off = request->offset;
+            if (request->iovCount > 0)
+            {
+                sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe->addr = (uint64_t)(uintptr_t)request->iov;
+                sqe->len = request->iovCount;
+            }
+            else
+            {
+                sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->addr = (uint64_t)(uintptr_t)request->buffer;
+                sqe->len = request->length;
+            }
+            sqe->user_data = done + i;
+            uring.sqArray[index] = index;
         }
+        __atomic_store_n(uring.sqTail, tail, __ATOMIC_RELEASE);
 
-        for (int i = 0; i < clusterSize; i += ENTRY_SIZE)
+        // One syscall submits everything and waits for all of it to complete
+        unsigned submitted = 0;
+        while (submitted < batch)
         {
-            if (buffer[i] == 0x00 || buffer[i] == 0xE5)
+            int n = syscall(__NR_io_uring_enter, uring.ringFd, batch - submitted, batch - submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (n < 0)
             {
-                return false;
+                if (errno == EINTR)
+                    continue;
+                perror("io_uring_enter failed");
+                return -1;
+            }
+            submitted += n;
+        }
+
+        // Reap the completions together
+        unsigned reaped = 0;
+        while (reaped < batch)
+        {
+            unsigned head = *uring.cqHead;
+            if (head == __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE))
+            {
+                if (syscall(__NR_io_uring_enter, uring.ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                {
+                    perror("io_uring_enter failed");
+                    return -1;
+                }
+                continue;
             }
+            struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cqMask];
+            IoRequest *request = &requests[cqe->user_data];
+            request->result = 0;
+            if (request->write)
+                device->unsynced = true;
+            if (cqe->res != (int)request->length && ioTransfer(request) != 0)
+                status = -1; // Short or failed transfer, finish it synchronously
+            __atomic_store_n(uring.cqHead, head + 1, __ATOMIC_RELEASE);
+            reaped++;
         }
+        done += batch;
+    }
+    return status;
+}
+#else
+int uringInit(unsigned entries)
+{
+    return -1;
+}
+
+void uringExit()
+{
+}
+#endif
+
+void readFSInfo()
+{
+    fsInfoValid = false;
+    fsInfoDirty = false;
+    if (bs.fsInfoSector == 0 || bs.fsInfoSector == 0xFFFF || bs.bytesPerSector < sizeof(fsInfoBuffer))
+        return;
+    if (readImage(fsInfoBuffer, sizeof(fsInfoBuffer), (off_t)bs.fsInfoSector * bs.bytesPerSector) != 0)
+        return;
 
-        parentCluster = readFATEntry(parentCluster); 
-    } while (parentCluster < 0x0FFFFFF8);
+    uint32_t leadSig, structSig, freeCount, nextFree;
+    memcpy(&leadSig, fsInfoBuffer, 4);
+    memcpy(&structSig, fsInfoBuffer + 484, 4);
+    memcpy(&freeCount, fsInfoBuffer + 488, 4);
+    memcpy(&nextFree, fsInfoBuffer + 492, 4);
+    if (leadSig != 0x41615252 || structSig != 0x61417272)
+        return;
+    fsInfoValid = true;
+
+    // The next-free hint is where the previous allocation left off
+    if (nextFree >= 2 && nextFree < clusterLimit)
+        nextFreeCursor = nextFree;
+    // The free count is only advisory; correct it on the next sync if stale
+    if (freeCount != freeClusterTotal)
+        fsInfoDirty = true;
+}
 
-    return true; // No free entry found in any cluster, directory is full
+void updateFSInfoBuffer()
+{
+    uint32_t nextFree = nextFreeCursor;
+    memcpy(fsInfoBuffer + 488, &freeClusterTotal, 4);
+    memcpy(fsInfoBuffer + 492, &nextFree, 4);
 }
-int expandDirectory(uint32_t parentCluster)
+
+int flushFSInfo()
 {
-    uint32_t newCluster = allocateCluster();
-    if (newCluster == 0)
-    {
-        printf("No free clusters available to allocate for new directory.\n");
+    if (!fsInfoValid || !fsInfoDirty)
+        return 0;
+    updateFSInfoBuffer();
+    if (writeImage(fsInfoBuffer, sizeof(fsInfoBuffer), (off_t)bs.fsInfoSector * bs.bytesPerSector) != 0)
         return -1;
-    }
+    fsInfoDirty = false;
+    return 0;
+}
 
-    if (linkClusterToDirectory(parentCluster, newCluster) != 0)
+int syncImage()
+{
+    int status = cacheFlush();
+    if (journalActive)
     {
-        printf("Failed to link new cluster to extend directory capacity.\n");
-        return -1;
+        // Metadata goes through the journal, one sequential fsync covers the whole batch
+        if (journalCommit() != 0)
+            status = -1;
+        return status;
     }
-
-    return newCluster;
+    if (flushFAT() != 0)
+        status = -1;
+    if (flushFSInfo() != 0)
+        status = -1;
+    // Let the backend make everything durable: fdatasync, msync, or persisting the RAM disk
+    if ((device->unsynced || device->zeroCopy) && device->flush(device) != 0)
+        status = -1;
+    return status;
 }
 
-int addDirectory(uint32_t parentCluster, const char *dirName)
+int journalOpen(const char *imageName, bool enable)
 {
-    if (isDirectoryFull(parentCluster))
+    char *path = malloc(strlen(imageName) + sizeof(".jnl"));
+    if (!path)
+        return -1;
+    sprintf(path, "%s.jnl", imageName);
+    journalFd = open(path, enable ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    free(path);
+    if (journalFd == -1)
     {
-        printf("Directory is full. Cannot add new directory.\n");
+        if (!enable && errno == ENOENT)
+            return 0; // No journal, nothing to replay
+        perror("Failed to open journal");
         return -1;
     }
-
-    uint32_t newCluster = allocateCluster();
-    if (newCluster == 0)
+    if (journalReplay() != 0)
     {
-        printf("No free clusters available to allocate for new directory.\n");
+        journalClose();
         return -1;
     }
-
-    if (writeDirectoryEntry(parentCluster, dirName, newCluster, ATTR_DIRECTORY) != 0)
+    if (!enable)
     {
-        printf("Failed to write new directory entry.\n");
-        return -1;
+        journalClose();
+        return 0;
     }
-
-    return initDirectoryCluster(newCluster, parentCluster);
+    journalActive = true;
+    journalTail = 0;
+    journalSequence = 1;
+    return 0;
 }
 
-int linkClusterToDirectory(uint32_t directoryCluster, uint32_t newCluster)
+void journalClose()
 {
-    uint32_t lastCluster = directoryCluster;
-    uint32_t nextCluster;
+    if (journalFd != -1)
+        close(journalFd);
+    journalFd = -1;
+    journalActive = false;
+    journalTail = 0;
+}
 
-    while ((nextCluster = readFATEntry(lastCluster)) != 0x0FFFFFFF)
+uint32_t journalChecksum(const uint8_t *data, size_t length)
+{
+    // FNV-1a, enough to tell a torn record from a complete one
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
     {
-        lastCluster = nextCluster; // Follow chain to end
+        hash ^= data[i];
+        hash *= 16777619u;
     }
-
-    // Link the new cluster
-    writeFATEntry(lastCluster, newCluster);
-    writeFATEntry(newCluster, 0x0FFFFFFF); // Mark the new cluster as end of chain
-
-    return 0; 
+    return hash;
 }
-void processCommand(tokenlist *tokens)
-{
-    if (tokens->size == 0)
-        return;
 
-    if (strcmp(tokens->items[0], "info") == 0)
+void journalAppend(uint8_t *log, size_t *used, uint32_t type, uint64_t offset, const void *data, uint32_t length)
+{
+    JournalRecord record = {0};
+    record.magic = JOURNAL_MAGIC;
+    record.type = type;
+    record.sequence = journalSequence;
+    record.offset = offset;
+    record.length = length;
+    if (type == JOURNAL_BLOCK)
+        record.checksum = journalChecksum(data, length);
+    memcpy(log + *used, &record, sizeof(record));
+    *used += sizeof(record);
+    if (type == JOURNAL_BLOCK)
     {
-        printInfo();
+        memcpy(log + *used, data, length);
+        *used += length;
     }
-    else if (strcmp(tokens->items[0], "cd") == 0)
+}
+
+int journalCommit()
+{
+    if (!journalActive)
+        return 0;
+
+    // Gather every pending metadata update: directory clusters, FAT runs and FSInfo
+    int32_t *slots = malloc((cacheCapacity + 1) * sizeof(int32_t));
+    if (!slots)
+        return -1;
+    size_t size = sizeof(JournalRecord); // Commit record
+    int slotCount = 0;
+    for (uint32_t i = 0; i < cacheCapacity; i++)
     {
-        if (tokens->size > 1)
+        if (cacheEntries[i].cluster != 0 && cacheEntries[i].dirty && cacheEntries[i].metadata)
         {
-            uint32_t newDirCluster = findDirectoryCluster(tokens->items[1]);
-            if (newDirCluster)
-            {
-                currentDirectoryCluster = newDirCluster;
-                printf("Changed directory to %s\n", tokens->items[1]);
-                if (strcmp(tokens->items[1], "..") != 0 && strcmp(tokens->items[1], ".") != 0)
-                {
-                    pushDir(tokens->items[1], newDirCluster);
-                }
-            }
-            else
-            {
-                printf("Directory not found: %s\n", tokens->items[1]);
-            }
+            // Only the sectors that changed are logged
+            slots[slotCount++] = i;
+            uint32_t sector = 0, runStart, runEnd;
+            while (nextDirtySectorRun(&cacheEntries[i], &sector, &runStart, &runEnd))
+                size += sizeof(JournalRecord) + (size_t)(runEnd - runStart) * bs.bytesPerSector;
         }
     }
-    else if (strcmp(tokens->items[0], "ls") == 0)
+    uint8_t firstCopy, lastCopy;
+    fatCopyRange(&firstCopy, &lastCopy);
+    uint32_t sector = 0, runStart, runEnd;
+    bool fatPending = false;
+    while (nextDirtyFATRun(&sector, &runStart, &runEnd))
     {
-        listDirectory(currentDirectoryCluster);
+        size += (size_t)(lastCopy - firstCopy) * (sizeof(JournalRecord) + (size_t)(runEnd - runStart) * bs.bytesPerSector);
+        fatPending = true;
     }
-    else if (strcmp(tokens->items[0], "mkdir") == 0 && tokens->size > 1)
+    bool fsInfoPending = fsInfoValid && fsInfoDirty;
+    if (fsInfoPending)
+        size += sizeof(JournalRecord) + sizeof(fsInfoBuffer);
+    if (slotCount == 0 && !fatPending && !fsInfoPending)
     {
-        if (createDirectory(tokens->items[1]) == 0)
-        {
-            printf("Directory created: %s\n", tokens->items[1]);
-        }
-        else
-        {
-            printf("Failed to create directory: %s\n", tokens->items[1]);
-        }
+        free(slots);
+        return 0;
     }
-    else if (strcmp(tokens->items[0], "creat") == 0 && tokens->size > 1)
+
+    uint8_t *log = malloc(size);
+    if (!log)
     {
-        if (createFile(tokens->items[1]) == 0)
-        {
-            printf("File '%s' created successfully.\n", tokens->items[1]);
-        }
-        else
+        printf("Failed to allocate the journal transaction.\n");
+        free(slots);
+        return -1;
+    }
+    size_t used = 0;
+    uint32_t blocks = 0;
+    for (int i = 0; i < slotCount; i++)
+    {
+        CacheEntry *entry = &cacheEntries[slots[i]];
+        uint64_t base = (uint64_t)clusterToSector(entry->cluster) * bs.bytesPerSector;
+        sector = 0;
+        while (nextDirtySectorRun(entry, &sector, &runStart, &runEnd))
         {
-            printf("Failed to create file: %s\n", tokens->items[1]);
+            journalAppend(log, &used, JOURNAL_BLOCK, base + (uint64_t)runStart * bs.bytesPerSector,
+                          entry->data + runStart * bs.bytesPerSector, (runEnd - runStart) * bs.bytesPerSector);
+            blocks++;
         }
     }
-    else if (strcmp(tokens->items[0], "mount") == 0 && tokens->size > 1)
+    sector = 0;
+    while (nextDirtyFATRun(&sector, &runStart, &runEnd))
     {
-        if (mountImage(tokens->items[1]) == 0)
+        size_t runBytes = (size_t)(runEnd - runStart) * bs.bytesPerSector;
+        off_t runOffset = (off_t)runStart * bs.bytesPerSector;
+        for (uint8_t copy = firstCopy; copy < lastCopy; copy++)
         {
-            printf("Mounted image: %s\n", tokens->items[1]);
+            journalAppend(log, &used, JOURNAL_BLOCK, fatCopyOffset(copy) + runOffset, (uint8_t *)fatTable + runOffset, runBytes);
+            blocks++;
         }
-        else
+    }
+    if (fsInfoPending)
+    {
+        updateFSInfoBuffer();
+        journalAppend(log, &used, JOURNAL_BLOCK, (uint64_t)bs.fsInfoSector * bs.bytesPerSector, fsInfoBuffer, sizeof(fsInfoBuffer));
+        blocks++;
+    }
+    journalAppend(log, &used, JOURNAL_COMMIT, 0, NULL, blocks);
+
+    // The transaction is appended with one sequential write and made durable with one fsync
+    size_t done = 0;
+    while (done < used)
+    {
+        ssize_t n = pwrite(journalFd, log + done, used - done, journalTail + done);
+        if (n <= 0)
         {
-            printf("Failed to mount image: %s\n", tokens->items[1]);
+            perror("Failed to write journal");
+            free(log);
+            free(slots);
+            return -1;
         }
+        done += n;
     }
-    else if (strcmp(tokens->items[0], "open") == 0 && tokens->size == 3)
+    free(log);
+    free(slots);
+    if (fdatasync(journalFd) != 0)
     {
-        openFile(tokens->items[1], tokens->items[2]);
+        perror("Failed to sync journal");
+        return -1;
     }
-    else if (strcmp(tokens->items[0], "close") == 0 && tokens->size == 2)
+    journalTail += used;
+    journalSequence++;
+
+    // Committed: update the image in place, replay repairs it if this is cut short
+    int status = cacheFlushKinds(false, true);
+    if (flushFAT() != 0)
+        status = -1;
+    if (flushFSInfo() != 0)
+        status = -1;
+    if (status == 0 && journalTail >= JOURNAL_CHECKPOINT_BYTES)
+        status = journalCheckpoint();
+    return status;
+}
+
+int journalCheckpoint()
+{
+    if (!journalActive || journalTail == 0)
+        return 0;
+    // Once the in-place writes are durable the journal can start over
+    if (device->flush(device) != 0)
+        return -1;
+    if (ftruncate(journalFd, 0) != 0 || fdatasync(journalFd) != 0)
     {
-        closeFile(tokens->items[1]);
+        perror("Failed to reset journal");
+        return -1;
     }
-    else if (strcmp(tokens->items[0], "lsof") == 0)
+    journalTail = 0;
+    return 0;
+}
+
+int journalReplay()
+{
+    off_t size = lseek(journalFd, 0, SEEK_END);
+    if (size <= 0)
+        return size == 0 ? 0 : -1;
+    uint8_t *log = malloc(size);
+    if (!log)
     {
-        listOpenFiles();
+        printf("Failed to allocate memory for journal replay.\n");
+        return -1;
     }
-    else if (strcmp(tokens->items[0], "rm") == 0 && tokens->size > 1)
+    off_t done = 0;
+    while (done < size)
     {
-        if (deleteFile(tokens->items[1]))
-        {
-            printf("File '%s' removed successfully.\n", tokens->items[1]);
-        }
-        else
+        ssize_t n = pread(journalFd, log + done, size - done, done);
+        if (n <= 0)
         {
-            printf("Failed to remove file '%s'.\n", tokens->items[1]);
+            perror("Failed to read journal");
+            free(log);
+            return -1;
         }
+        done += n;
     }
-    else if (strcmp(tokens->items[0], "lseek") == 0 && tokens->size == 3)
+
+    // Apply complete transactions in sequence order, stop at the first torn or stale one
+    size_t position = 0, transactionStart = 0;
+    uint32_t blocks = 0;
+    uint64_t sequence = 0, lastApplied = 0;
+    int applied = 0;
+    while (position + sizeof(JournalRecord) <= (size_t)size)
     {
-        const char *filename = tokens->items[1];
-        long offset = strtol(tokens->items[2], NULL, 10); // Convert string to long
-        if (seekFile(filename, offset) == -1)
+        JournalRecord record;
+        memcpy(&record, log + position, sizeof(record));
+        if (record.magic != JOURNAL_MAGIC)
+            break;
+        if (blocks == 0)
         {
-            printf("Failed to set file offset.\n");
+            if (lastApplied != 0 && record.sequence != lastApplied + 1)
+                break;
+            transactionStart = position;
+            sequence = record.sequence;
         }
-    }
-    else if (strcmp(tokens->items[0], "read") == 0 && tokens->size == 3)
-    {
-        const char *filename = tokens->items[1];
-        int size = atoi(tokens->items[2]); // Convert size from string to integer
+        else if (record.sequence != sequence)
+            break;
 
-        if (readFile(filename, size) == -1)
-        {
-            printf("Failed to read file: %s\n", filename);
-        }
-    }
-    else if (strcmp(tokens->items[0], "write") == 0 && tokens->size > 2)
-    {
-        // Call writeToFile function with filename and data parameters
-        const char *data = getString(tokens);
-        if (writeToFile(tokens->items[1], data) == 0)
+        if (record.type == JOURNAL_BLOCK)
         {
-            printf("Data written successfully to '%s'.\n", tokens->items[1]);
+            if (record.length > size - position - sizeof(record) ||
+                journalChecksum(log + position + sizeof(record), record.length) != record.checksum)
+                break;
+            blocks++;
+            position += sizeof(record) + record.length;
+            continue;
         }
-        else
+        if (record.type != JOURNAL_COMMIT || record.length != blocks || blocks == 0)
+            break;
+
+        for (size_t p = transactionStart; p < position;)
         {
-            printf("Failed to write data to '%s'.\n", tokens->items[1]);
+            JournalRecord block;
+            memcpy(&block, log + p, sizeof(block));
+            if (writeImage(log + p + sizeof(block), block.length, block.offset) != 0)
+            {
+                free(log);
+                return -1;
+            }
+            p += sizeof(block) + block.length;
         }
+        applied++;
+        lastApplied = sequence;
+        blocks = 0;
+        position += sizeof(record);
     }
-    else if (strcmp(tokens->items[0], "exit") == 0)
+    free(log);
+
+    if (applied)
     {
-        printf("Exiting program.\n");
-        exit(0);
+        if (device->flush(device) != 0)
+            return -1;
+        printf("Replayed %d journal transaction(s).\n", applied);
     }
-    else
+    // Everything committed is in the image now, start the journal over
+    if (ftruncate(journalFd, 0) != 0 || fdatasync(journalFd) != 0)
     {
-        // print tokensize
-        printf("Unknown command.\n");
+        perror("Failed to reset journal");
+        return -1;
     }
+    return 0;
 }
 
-bool is_8_3_format_directory(const char *name)
+int loadFAT(bool checkMirrors)
 {
-    if (!name)
-        return false;
-    int nameLen = 0, extLen = 0;
-    bool dotSeen = false;
-
-    for (int i = 0; name[i] != '\0'; i++)
+    size_t fatBytes = (size_t)bs.FATSize * bs.bytesPerSector;
+    off_t fatStart = fatCopyOffset(fatMirroringEnabled() ? 0 : activeFAT());
+    fatDirty = calloc(bs.FATSize, 1);
+    if (imageMap && fatStart + fatBytes <= imageMapSize)
     {
-        if (name[i] == '.')
-        {
-            if (dotSeen)
-                return false; // Only one dot allowed
-            dotSeen = true;
-            continue;
-        }
-        if (!isalnum(name[i]) && name[i] != '_')
-            return false; 
+        // Use the mapping directly; FAT lookups jump around, so disable readahead there
+        fatTable = (uint32_t *)(imageMap + fatStart);
+        fatMapped = true;
+        madvise(imageMap + fatStart, fatBytes, MADV_RANDOM);
+    }
+    else
+    {
+        fatTable = alignedAlloc(fatBytes);
+    }
+    if (!fatTable || !fatDirty)
+    {
+        printf("Failed to allocate memory for the FAT.\n");
+        freeFAT();
+        return -1;
+    }
 
-        if (dotSeen)
-        {
-            if (++extLen > 3)
-                return false; 
-        }
-        else
+    // One large read for the whole region instead of one per entry lookup
+    if (!fatMapped && readImage(fatTable, fatBytes, fatStart) != 0)
+    {
+        freeFAT();
+        return -1;
+    }
+    fatEntryCount = fatBytes / sizeof(uint32_t);
+    if (checkMirrors)
+        markStaleMirrorSectors(); // A full read of every mirror, so only on request
+    return buildFreeMap();
+}
+
+bool fatMirroringEnabled()
+{
+    return (bs.extFlags & 0x80) == 0; // Bit 7 set means only the active FAT is in use
+}
+
+uint8_t activeFAT()
+{
+    uint8_t active = bs.extFlags & 0x0F;
+    return active < bs.numFATs ? active : 0;
+}
+
+off_t fatCopyOffset(uint8_t copy)
+{
+    return ((off_t)bs.reservedSectors + (off_t)copy * bs.FATSize) * bs.bytesPerSector;
+}
+
+void markStaleMirrorSectors()
+{
+    if (!fatMirroringEnabled() || bs.numFATs < 2)
+        return;
+
+    // Compare the mirrors in fixed-size pieces so sectors that drifted are rewritten on the next flush
+    uint32_t step = 64;
+    uint8_t *buffer = alignedAlloc((size_t)step * bs.bytesPerSector);
+    if (!buffer)
+        return;
+    for (uint8_t copy = 1; copy < bs.numFATs; copy++)
+    {
+        for (uint32_t sector = 0; sector < bs.FATSize; sector += step)
         {
-            if (++nameLen > 8)
-                return false; 
+            uint32_t count = (bs.FATSize - sector < step) ? bs.FATSize - sector : step;
+            size_t bytes = (size_t)count * bs.bytesPerSector;
+            off_t offset = (off_t)sector * bs.bytesPerSector;
+            if (readImage(buffer, bytes, fatCopyOffset(copy) + offset) != 0)
+            {
+                memset(fatDirty + sector, 1, count);
+                continue;
+            }
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (memcmp(buffer + (size_t)i * bs.bytesPerSector, (uint8_t *)fatTable + offset + (size_t)i * bs.bytesPerSector, bs.bytesPerSector) != 0)
+                    fatDirty[sector + i] = 1;
+            }
         }
     }
-    return nameLen > 0 && (!dotSeen || extLen > 0); 
+    free(buffer);
 }
 
-bool is_8_3_format_filename(const char *name)
+int buildFreeMap()
 {
-    int nameLen = 0, extLen = 0;
-    bool dotSeen = false;
-
-    if (name == NULL)
-        return false;
+    uint32_t dataClusters = (bs.totalSectors - bs.firstDataSector) / bs.sectorsPerCluster;
+    clusterLimit = dataClusters + 2;
+    if (clusterLimit > fatEntryCount)
+        clusterLimit = fatEntryCount;
+
+    uint32_t words = (clusterLimit + 63) / 64;
+    uint32_t chunks = (clusterLimit + FREE_CHUNK_CLUSTERS - 1) / FREE_CHUNK_CLUSTERS;
+    freeMap = calloc(words, sizeof(uint64_t));
+    freeChunkCount = calloc(chunks, sizeof(uint32_t));
+    if (!freeMap || !freeChunkCount)
+    {
+        printf("Failed to allocate memory for the free cluster map.\n");
+        freeFAT();
+        return -1;
+    }
 
-    for (int i = 0; name[i] != '\0'; i++)
+    freeClusterTotal = 0;
+    for (uint32_t c = 2; c < clusterLimit; c++)
     {
-        // Check if the current character is a dot
-        if (name[i] == '.')
+        if ((fatTable[c] & 0x0FFFFFFF) == 0)
         {
-            // If a dot is already seen or it appears as the first character, return false
-            if (dotSeen || i == 0)
-                return false;
-            dotSeen = true;
-            continue;
+            freeMap[c / 64] |= 1ULL << (c % 64);
+            freeChunkCount[c / FREE_CHUNK_CLUSTERS]++;
+            freeClusterTotal++;
         }
+    }
+    nextFreeCursor = 2;
+    return 0;
+}
 
-        if (!isalnum(name[i]) && name[i] != '_')
-            return false;
+void setClusterFree(uint32_t cluster, bool isFree)
+{
+    if (cluster < 2 || cluster >= clusterLimit)
+        return;
+    uint64_t bit = 1ULL << (cluster % 64);
+    bool wasFree = (freeMap[cluster / 64] & bit) != 0;
+    if (wasFree == isFree)
+        return;
+    if (isFree)
+    {
+        freeMap[cluster / 64] |= bit;
+        freeChunkCount[cluster / FREE_CHUNK_CLUSTERS]++;
+        freeClusterTotal++;
+    }
+    else
+    {
+        freeMap[cluster / 64] &= ~bit;
+        freeChunkCount[cluster / FREE_CHUNK_CLUSTERS]--;
+        freeClusterTotal--;
+    }
+    fsInfoDirty = true;
+}
 
-        if (dotSeen)
+uint32_t findFreeClusterInRange(uint32_t from, uint32_t to)
+{
+    if (to > clusterLimit)
+        to = clusterLimit;
+    uint32_t cluster = from;
+    while (cluster < to)
+    {
+        uint32_t chunk = cluster / FREE_CHUNK_CLUSTERS;
+        uint32_t chunkEnd = (chunk + 1) * FREE_CHUNK_CLUSTERS;
+        if (freeChunkCount[chunk] == 0)
         {
-            extLen++;
-            if (extLen > 3)
-                return false;
+            cluster = chunkEnd; // Whole chunk is in use
+            continue;
         }
-        else
+        uint64_t bits = freeMap[cluster / 64] & (~0ULL << (cluster % 64));
+        if (bits)
         {
-            nameLen++;
-            if (nameLen > 8)
-                return false;
+            uint32_t found = (cluster & ~63u) + __builtin_ctzll(bits);
+            return found < to ? found : 0;
         }
+        cluster = (cluster & ~63u) + 64;
     }
+    return 0;
+}
 
-    return nameLen > 0 && (!dotSeen || extLen > 0);
+uint32_t findFreeCluster(uint32_t start)
+{
+    if (freeClusterTotal == 0)
+        return 0;
+    if (start < 2 || start >= clusterLimit)
+        start = 2;
+
+    // Search from the cursor to the end, then wrap around to the beginning
+    uint32_t cluster = findFreeClusterInRange(start, clusterLimit);
+    if (cluster == 0)
+        cluster = findFreeClusterInRange(2, start);
+    return cluster;
 }
-void toUpperCase(char *str)
+
+uint32_t freeRunLength(uint32_t cluster, uint32_t max)
 {
-    while (*str)
+    uint32_t length = 0;
+    while (length < max && cluster + length < clusterLimit)
     {
-        *str = toupper((unsigned char)*str);
-        str++;
+        uint32_t c = cluster + length;
+        uint64_t bits = freeMap[c / 64] >> (c % 64);
+        if (bits == 0)
+            break;
+        uint32_t ones = (~bits == 0) ? 64 - (c % 64) : (uint32_t)__builtin_ctzll(~bits);
+        length += ones;
+        if (ones < 64 - (c % 64))
+            break; // Hit a used cluster inside this word
     }
+    return length < max ? length : max;
 }
-bool fileExists(const char *filename)
+
+uint32_t findFreeExtent(uint32_t start, uint32_t want, uint32_t *length)
 {
-    char filenameFAT[12];         
-    memset(filenameFAT, ' ', 11); // Initialize with spaces to match FAT32 format
-    filenameFAT[11] = '\0';       
+    uint32_t bestStart = 0, bestLength = 0;
+    if (start < 2 || start >= clusterLimit)
+        start = 2;
 
-    // Convert input filename to upper case and format it as FAT32 filename
-    int nameLen = 0;
-    for (int i = 0; i < strlen(filename) && nameLen < 11; i++)
+    // Next-fit: the first run from the cursor that holds everything wins,
+    // otherwise fall back to the largest run seen during one full pass
+    for (int pass = 0; pass < 2; pass++)
     {
-        if (filename[i] != '.')
+        uint32_t cluster = pass == 0 ? start : 2;
+        uint32_t end = pass == 0 ? clusterLimit : start;
+        while ((cluster = findFreeClusterInRange(cluster, end)) != 0)
         {
-            filenameFAT[nameLen++] = toupper((unsigned char)filename[i]);
+            uint32_t run = freeRunLength(cluster, want);
+            if (run >= want)
+            {
+                *length = want;
+                return cluster;
+            }
+            if (run > bestLength)
+            {
+                bestStart = cluster;
+                bestLength = run;
+            }
+            cluster += run;
         }
-        else
+    }
+    *length = bestLength;
+    return bestStart;
+}
+
+uint32_t allocateClusters(uint32_t count, uint32_t prevCluster)
+{
+    if (count == 0 || count > freeClusterTotal)
+        return 0;
+
+    uint32_t firstCluster = 0;
+    uint32_t remaining = count;
+    while (remaining > 0)
+    {
+        uint32_t runLength = 0;
+        uint32_t runStart = 0;
+        // Grow in place when the clusters right after the chain are free
+        if (prevCluster >= 2 && prevCluster + 1 < clusterLimit)
         {
-            break;
+            runLength = freeRunLength(prevCluster + 1, remaining);
+            if (runLength > 0)
+                runStart = prevCluster + 1;
         }
+        if (runStart == 0)
+            runStart = findFreeExtent(nextFreeCursor, remaining, &runLength);
+        if (runStart == 0 || runLength == 0)
+            return 0; // Cannot happen while freeClusterTotal covers count
+
+        linkClusterRun(runStart, runLength);
+        if (prevCluster >= 2)
+            writeFATEntry(prevCluster, runStart);
+        if (firstCluster == 0)
+            firstCluster = runStart;
+
+        prevCluster = runStart + runLength - 1;
+        remaining -= runLength;
+        nextFreeCursor = prevCluster + 1;
     }
-    int dotIndex = strlen(filename) - 1;
-    while (dotIndex >= 0 && filename[dotIndex] != '.')
+    return firstCluster;
+}
+
+void linkClusterRun(uint32_t firstCluster, uint32_t length)
+{
+    // Every entry in the run points at its neighbour, the last one ends the chain
+    for (uint32_t i = 0; i + 1 < length; i++)
     {
-        dotIndex--;
+        writeFATEntry(firstCluster + i, firstCluster + i + 1);
     }
+    writeFATEntry(firstCluster + length - 1, 0x0FFFFFFF);
+}
 
-    if (dotIndex != -1)
-    {                     // There is an extension
-        int extIndex = 8; // Extension starts at 8th position in FAT32
-        for (int i = dotIndex + 1; i < strlen(filename) && extIndex < 11; i++)
-        {
-            filenameFAT[extIndex++] = toupper((unsigned char)filename[i]);
-        }
-    }
+void fatCopyRange(uint8_t *firstCopy, uint8_t *lastCopy)
+{
+    *firstCopy = fatMirroringEnabled() ? 0 : activeFAT();
+    *lastCopy = fatMirroringEnabled() ? bs.numFATs : activeFAT() + 1;
+}
 
-    uint8_t *buffer = malloc(bs.bytesPerSector * bs.sectorsPerCluster);
-    if (!buffer)
+bool nextDirtyFATRun(uint32_t *sector, uint32_t *runStart, uint32_t *runEnd)
+{
+    while (*sector < bs.FATSize && !fatDirty[*sector])
     {
-        perror("Memory allocation failed");
-        return true;
+        (*sector)++;
+    }
+    if (*sector >= bs.FATSize)
+        return false;
+    // Coalesce dirty sectors into one run, bridging small clean gaps
+    // since rewriting a few unchanged sectors is cheaper than another write
+    *runStart = *sector;
+    *runEnd = *sector;
+    while (*sector < bs.FATSize && *sector - *runEnd <= FAT_FLUSH_GAP)
+    {
+        if (fatDirty[*sector])
+            *runEnd = *sector + 1;
+        (*sector)++;
     }
+    *sector = *runEnd;
+    return true;
+}
 
-    uint32_t cluster = currentDirectoryCluster;
-    do
+int flushFAT()
+{
+    if (!fatTable)
+        return 0;
+
+    uint8_t firstCopy, lastCopy;
+    fatCopyRange(&firstCopy, &lastCopy);
+    uint32_t sector = 0, runStart, runEnd;
+    while (nextDirtyFATRun(&sector, &runStart, &runEnd))
     {
-        readCluster(cluster, buffer);
-        dentry_t *entry = (dentry_t *)buffer;
-        for (int i = 0; i < (bs.bytesPerSector * bs.sectorsPerCluster) / sizeof(dentry_t); i++, entry++)
-        {
-            if (entry->DIR_Name[0] == 0x00)
-                break;
-            if (entry->DIR_Name[0] == 0xE5)
-                continue;
+        size_t runBytes = (size_t)(runEnd - runStart) * bs.bytesPerSector;
+        off_t runOffset = (off_t)runStart * bs.bytesPerSector;
 
-            if (strncmp(entry->DIR_Name, filenameFAT, 11) == 0)
-            {
-                free(buffer);
-                return true;
-            }
+        // The same run goes to every FAT copy, so the mirror cost is paid once per batch
+        for (uint8_t copy = firstCopy; copy < lastCopy; copy++)
+        {
+            if (fatMapped && copy == firstCopy)
+                continue; // Already updated in place through the mapping
+            if (writeImage((uint8_t *)fatTable + runOffset, runBytes, fatCopyOffset(copy) + runOffset) != 0)
+                return -1;
         }
-        cluster = readFATEntry(cluster);
-    } while (cluster < 0x0FFFFFF8);
+        memset(fatDirty + runStart, 0, runEnd - runStart);
+    }
+    return 0;
+}
 
-    free(buffer);
-    return false;
+void freeFAT()
+{
+    if (!fatMapped)
+        free(fatTable);
+    fatMapped = false;
+    free(fatDirty);
+    free(freeMap);
+    free(freeChunkCount);
+    fatTable = NULL;
+    fatDirty = NULL;
+    freeMap = NULL;
+    freeChunkCount = NULL;
+    fatEntryCount = 0;
+    clusterLimit = 0;
+    freeClusterTotal = 0;
 }
 
-int createFile(const char *fileName)
+void printInfo()
 {
+    uint32_t totalDataSectors = bs.totalSectors - (bs.reservedSectors + (bs.FATSize * bs.numFATs * bs.sectorsPerCluster));
+    uint64_t totalClusters = totalDataSectors / bs.sectorsPerCluster;
+    printf("Bytes Per Sector: %d\n", bs.bytesPerSector);
+    printf("Sectors Per Cluster: %d\n", bs.sectorsPerCluster);
+    printf("Root Cluster: %d\n", bs.rootCluster);
+    printf("Total # of Clusters in Data Region: %lu\n", totalClusters);
+    printf("# of Entries in One FAT: %d\n", bs.FATSize * (bs.bytesPerSector / 4)); // Assuming 4 bytes per FAT entry
+    printf("Size of Image (in bytes): %lu\n", (uint64_t)bs.totalSectors * bs.bytesPerSector);
+    printf("Free Clusters: %u\n", freeClusterTotal); // Kept current by the allocator, no FAT scan needed
+    printf("Next Free Cluster Hint: %u\n", nextFreeCursor);
+}
 
-    if (!is_8_3_format_filename(fileName))
+uint32_t clusterToSector(uint32_t cluster)
+{
+    // The cluster number should be at least 2, as cluster numbers start from 2 in FAT32.
+    if (cluster < 2)
     {
-        printf("Error: File name '%s' is not in valid FAT32 8.3 format.\n", fileName);
-        return -1;
+        fprintf(stderr, "Invalid cluster number: %u. Cluster numbers should be >= 2.\n", cluster);
+        return 0; 
     }
+    // Calculate the sector number corresponding to the given cluster number.
+    uint32_t sector = ((cluster - 2) * bs.sectorsPerCluster) + bs.firstDataSector;
+    return sector;
+}
 
-    if (fileExists(fileName))
+int cacheInit(size_t budget)
+{
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t capacity = budget / clusterSize;
+    if (capacity < CACHE_MIN_ENTRIES)
+        capacity = CACHE_MIN_ENTRIES;
+
+    cacheEntries = calloc(capacity, sizeof(CacheEntry));
+    // Slots and the staging buffer form the aligned pool every data transfer goes through
+    cacheData = alignedAlloc((size_t)capacity * clusterSize);
+    stagingBuffer = alignedAlloc(IO_RUN_MAX_BYTES + 2 * (size_t)clusterSize);
+    cacheBucketCount = capacity * 2;
+    cacheBuckets = malloc(cacheBucketCount * sizeof(int32_t));
+    if (!cacheEntries || !cacheData || !stagingBuffer || !cacheBuckets)
     {
-        printf("Error: A file named '%s' already exists.\n", fileName);
+        printf("Failed to allocate the buffer cache.\n");
+        cacheDestroy();
         return -1;
     }
-
-    uint32_t fileCluster = allocateCluster();
-    if (fileCluster == 0)
+    for (uint32_t i = 0; i < cacheBucketCount; i++)
     {
-        printf("No free clusters available to create the file.\n");
-        return -1;
+        cacheBuckets[i] = -1;
+    }
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        cacheEntries[i].data = cacheData + (size_t)i * clusterSize;
+        cacheEntries[i].next = -1;
     }
+    cacheCapacity = capacity;
+    cacheClockHand = 0;
+    return 0;
+}
+
+void cacheDestroy()
+{
+    free(cacheEntries);
+    free(cacheData);
+    free(stagingBuffer);
+    free(cacheBuckets);
+    cacheEntries = NULL;
+    cacheData = NULL;
+    stagingBuffer = NULL;
+    cacheBuckets = NULL;
+    cacheCapacity = 0;
+    cacheBucketCount = 0;
+}
 
-    if (writeDirectoryEntry(currentDirectoryCluster, fileName, fileCluster, 0) != 0)
+int32_t cacheLookup(uint32_t cluster)
+{
+    int32_t index = cacheBuckets[cluster % cacheBucketCount];
+    while (index != -1 && cacheEntries[index].cluster != cluster)
     {
-        printf("Failed to write directory entry for the file.\n");
-        return -1;
+        index = cacheEntries[index].next;
     }
+    return index;
+}
 
-    printf("File '%s' created successfully.\n", fileName);
-    return 0;
+void cacheUnlink(int32_t index)
+{
+    int32_t *link = &cacheBuckets[cacheEntries[index].cluster % cacheBucketCount];
+    while (*link != index)
+    {
+        link = &cacheEntries[*link].next;
+    }
+    *link = cacheEntries[index].next;
+    cacheEntries[index].next = -1;
+    cacheEntries[index].cluster = 0;
 }
 
-void rightTrim(char *str)
+int32_t cacheClaimSlot()
 {
-    int end = strlen(str) - 1;
-    while (end >= 0 && str[end] == ' ')
+    // CLOCK: recently used slots get a second chance before they are evicted
+    for (uint32_t scanned = 0; scanned <= 2 * cacheCapacity; scanned++)
     {
-        str[end] = '\0';
-        end--;
+        int32_t index = cacheClockHand;
+        CacheEntry *entry = &cacheEntries[index];
+        cacheClockHand = (cacheClockHand + 1) % cacheCapacity;
+
+        if (entry->cluster == 0)
+            return index;
+        if (entry->referenced || entry->loading)
+        {
+            entry->referenced = false;
+            continue;
+        }
+        if (entry->dirty)
+        {
+            // Write back every dirty slot in one batch rather than just the victim
+            cacheFlush();
+            if (entry->dirty && journalActive)
+                journalCommit(); // Journaled directory clusters leave only through a commit
+            if (entry->dirty)
+                continue;
+        }
+        cacheUnlink(index);
+        return index;
     }
+    return -1;
 }
-void initOpenFiles()
+
+uint8_t *cacheLoad(uint32_t cluster, bool readFromDisk)
 {
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    if (cluster < 2 || cluster >= clusterLimit)
     {
-        openFiles[i].isOpeninuse = 0; // Mark all entries as unused
+        fprintf(stderr, "Invalid cluster number: %u\n", cluster);
+        return NULL;
     }
+    if (imageMap)
+    {
+        // Zero-copy: hand out the mapped cluster itself, msync writes it back
+        size_t offset = (size_t)clusterToSector(cluster) * bs.bytesPerSector;
+        if (offset + (size_t)bs.bytesPerSector * bs.sectorsPerCluster > imageMapSize)
+        {
+            fprintf(stderr, "Cluster %u lies past the end of the image\n", cluster);
+            return NULL;
+        }
+        return imageMap + offset;
+    }
+
+    int32_t index = cacheLookup(cluster);
+    if (index != -1)
+    {
+        cacheEntries[index].referenced = true;
+        return cacheEntries[index].data;
+    }
+
+    index = cacheClaimSlot();
+    if (index == -1)
+    {
+        printf("Buffer cache could not free a slot.\n");
+        return NULL;
+    }
+    CacheEntry *entry = &cacheEntries[index];
+    if (readFromDisk)
+    {
+        uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+        off_t offset = (off_t)clusterToSector(cluster) * bs.bytesPerSector;
+        if (readImage(entry->data, clusterSize, offset) != 0)
+            return NULL;
+    }
+    entry->cluster = cluster;
+    entry->dirty = false;
+    entry->metadata = false;
+    memset(entry->dirtySectors, 0, sizeof(entry->dirtySectors));
+    entry->referenced = true;
+    entry->loading = false;
+    uint32_t bucket = cluster % cacheBucketCount;
+    entry->next = cacheBuckets[bucket];
+    cacheBuckets[bucket] = index;
+    return entry->data;
 }
 
-int closeFile(const char *filename)
+uint8_t *cacheGetCluster(uint32_t cluster)
 {
-    if (!fileExists(filename))
+    return cacheLoad(cluster, true);
+}
+
+uint8_t *cacheOverwriteCluster(uint32_t cluster)
+{
+    // The caller replaces the whole cluster, so skip reading the old contents
+    uint8_t *data = cacheLoad(cluster, false);
+    if (data)
+        cacheMarkDirty(cluster);
+    return data;
+}
+
+void cacheMarkDirty(uint32_t cluster)
+{
+    cacheMarkRange(cluster, 0, bs.bytesPerSector * bs.sectorsPerCluster, false);
+}
+
+void cacheMarkMetadata(uint32_t cluster)
+{
+    cacheMarkRange(cluster, 0, bs.bytesPerSector * bs.sectorsPerCluster, true);
+}
+
+void cacheMarkRange(uint32_t cluster, uint32_t offset, uint32_t length, bool metadata)
+{
+    int32_t index = cacheLookup(cluster);
+    if (index == -1 || length == 0)
+        return;
+    // Only the sectors covering [offset, offset + length) are written back
+    CacheEntry *entry = &cacheEntries[index];
+    uint32_t last = (offset + length - 1) / bs.bytesPerSector;
+    for (uint32_t sector = offset / bs.bytesPerSector; sector <= last; sector++)
     {
-        printf("Error: File '%s' does not exist.\n", filename);
-        return -1;
+        entry->dirtySectors[sector / 64] |= 1ULL << (sector % 64);
+    }
+    entry->dirty = true;
+    if (metadata)
+        entry->metadata = true;
+}
+
+void cacheMarkEntry(uint32_t cluster, const dentry_t *entry)
+{
+    // Directory entry updates dirty only the sector holding the entry
+    int32_t index = cacheLookup(cluster);
+    if (index != -1)
+        cacheMarkRange(cluster, (const uint8_t *)entry - cacheEntries[index].data, sizeof(dentry_t), true);
+}
+
+bool cacheFullyDirty(const CacheEntry *entry)
+{
+    for (uint32_t sector = 0; sector < bs.sectorsPerCluster; sector++)
+    {
+        if (!(entry->dirtySectors[sector / 64] & (1ULL << (sector % 64))))
+            return false;
+    }
+    return true;
+}
+
+bool nextDirtySectorRun(const CacheEntry *entry, uint32_t *sector, uint32_t *runStart, uint32_t *runEnd)
+{
+    while (*sector < bs.sectorsPerCluster && !(entry->dirtySectors[*sector / 64] & (1ULL << (*sector % 64))))
+        (*sector)++;
+    if (*sector >= bs.sectorsPerCluster)
+        return false;
+    *runStart = *sector;
+    while (*sector < bs.sectorsPerCluster && (entry->dirtySectors[*sector / 64] & (1ULL << (*sector % 64))))
+        (*sector)++;
+    *runEnd = *sector;
+    return true;
+}
+
+int compareSlotClusters(const void *a, const void *b)
+{
+    uint32_t left = cacheEntries[*(const int32_t *)a].cluster;
+    uint32_t right = cacheEntries[*(const int32_t *)b].cluster;
+    return (left > right) - (left < right);
+}
+
+int transferCacheSlots(int32_t *slots, int count, bool write, int *results)
+{
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    IoRequest *requests = malloc(count * sizeof(IoRequest));
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    int *firstSlot = malloc(count * sizeof(int));
+    if (!requests || !iov || !firstSlot)
+    {
+        free(requests);
+        free(iov);
+        free(firstSlot);
+        printf("Failed to allocate the cache I/O batch.\n");
+        return -1;
+    }
+
+    // Slots for physically adjacent clusters become one vectored request
+    qsort(slots, count, sizeof(int32_t), compareSlotClusters);
+    int requestCount = 0;
+    for (int i = 0; i < count;)
+    {
+        int runStart = i;
+        do
+        {
+            iov[i].iov_base = cacheEntries[slots[i]].data;
+            iov[i].iov_len = clusterSize;
+            i++;
+        } while (i < count && i - runStart < IO_MAX_IOV &&
+                 cacheEntries[slots[i]].cluster == cacheEntries[slots[i - 1]].cluster + 1);
+
+        IoRequest *request = &requests[requestCount];
+        request->buffer = NULL;
+        request->length = (size_t)(i - runStart) * clusterSize;
+        request->offset = (off_t)clusterToSector(cacheEntries[slots[runStart]].cluster) * bs.bytesPerSector;
+        request->write = write;
+        request->iov = &iov[runStart];
+        request->iovCount = i - runStart;
+        firstSlot[requestCount++] = runStart;
+    }
+
+    int status = submitIoBatch(requests, requestCount);
+    for (int r = 0; r < requestCount; r++)
+    {
+        int end = (r + 1 < requestCount) ? firstSlot[r + 1] : count;
+        for (int i = firstSlot[r]; i < end; i++)
+        {
+            results[i] = requests[r].result;
+        }
+    }
+    free(requests);
+    free(iov);
+    free(firstSlot);
+    return status;
+}
+
+int cacheFlush()
+{
+    // With journaling on, directory clusters are written by journalCommit instead
+    return cacheFlushKinds(true, !journalActive);
+}
+
+int cacheWriteSectorRuns(int32_t *slots, int count, int *results)
+{
+    // Each run of dirty sectors in a partially modified cluster is its own write
+    int requestCount = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t sector = 0, runStart, runEnd;
+        while (nextDirtySectorRun(&cacheEntries[slots[i]], &sector, &runStart, &runEnd))
+            requestCount++;
+    }
+    IoRequest *requests = malloc(requestCount * sizeof(IoRequest));
+    int *owner = malloc(requestCount * sizeof(int));
+    if (!requests || !owner)
+    {
+        free(requests);
+        free(owner);
+        printf("Failed to allocate the cache I/O batch.\n");
+        return -1;
+    }
+
+    int r = 0;
+    for (int i = 0; i < count; i++)
+    {
+        CacheEntry *entry = &cacheEntries[slots[i]];
+        off_t base = (off_t)clusterToSector(entry->cluster) * bs.bytesPerSector;
+        uint32_t sector = 0, runStart, runEnd;
+        while (nextDirtySectorRun(entry, &sector, &runStart, &runEnd))
+        {
+            requests[r].buffer = entry->data + runStart * bs.bytesPerSector;
+            requests[r].length = (size_t)(runEnd - runStart) * bs.bytesPerSector;
+            requests[r].offset = base + (off_t)runStart * bs.bytesPerSector;
+            requests[r].write = true;
+            requests[r].iov = NULL;
+            requests[r].iovCount = 0;
+            owner[r++] = i;
+        }
+        results[i] = 0;
+    }
+
+    int status = submitIoBatch(requests, requestCount);
+    for (r = 0; r < requestCount; r++)
+    {
+        if (requests[r].result != 0)
+            results[owner[r]] = -1;
+    }
+    free(requests);
+    free(owner);
+    return status;
+}
+
+int cacheFlushKinds(bool data, bool metadata)
+{
+    int32_t *slots = malloc(cacheCapacity * sizeof(int32_t));
+    int *results = malloc(cacheCapacity * sizeof(int));
+    if (!slots || !results)
+    {
+        free(slots);
+        free(results);
+        printf("Failed to allocate the cache flush batch.\n");
+        return -1;
+    }
+
+    // Fully dirty clusters go first as coalesced runs, the rest as sector runs at the back
+    int whole = 0;
+    int partialStart = cacheCapacity;
+    for (uint32_t i = 0; i < cacheCapacity; i++)
+    {
+        CacheEntry *entry = &cacheEntries[i];
+        if (entry->cluster == 0 || !entry->dirty || !(entry->metadata ? metadata : data))
+            continue;
+        if (cacheFullyDirty(entry))
+            slots[whole++] = i;
+        else
+            slots[--partialStart] = i;
+    }
+
+    for (uint32_t i = 0; i < cacheCapacity; i++)
+    {
+        results[i] = -1;
+    }
+    int status = whole ? transferCacheSlots(slots, whole, true, results) : 0;
+    int partial = cacheCapacity - partialStart;
+    if (partial && cacheWriteSectorRuns(slots + partialStart, partial, results + partialStart) != 0)
+        status = -1;
+    for (int i = 0; i < whole; i++)
+    {
+        if (results[i] == 0)
+            cacheMarkClean(&cacheEntries[slots[i]]);
+    }
+    for (uint32_t i = partialStart; i < cacheCapacity; i++)
+    {
+        if (results[i] == 0)
+            cacheMarkClean(&cacheEntries[slots[i]]);
+    }
+    free(slots);
+    free(results);
+    return status;
+}
+
+void cacheMarkClean(CacheEntry *entry)
+{
+    entry->dirty = false;
+    memset(entry->dirtySectors, 0, sizeof(entry->dirtySectors));
+}
+
+void cacheDiscard(uint32_t cluster)
+{
+    // A freed cluster's slot must not be written back over its next owner
+    if (!cacheBuckets)
+        return;
+    int32_t index = cacheLookup(cluster);
+    if (index == -1)
+        return;
+    cacheMarkClean(&cacheEntries[index]);
+    cacheEntries[index].metadata = false;
+    cacheUnlink(index);
+}
+
+void cachePrefetch(const uint32_t *clusters, uint32_t count)
+{
+    if (imageMap || count == 0)
+        return; // Mapped clusters need no staging
+    if (count > cacheCapacity / 2)
+        count = cacheCapacity / 2; // Never evict what this batch is loading
+
+    int32_t *slots = malloc(count * sizeof(int32_t));
+    int *results = malloc(count * sizeof(int));
+    if (!slots || !results)
+    {
+        free(slots);
+        free(results);
+        return; // Prefetching is only an optimisation
+    }
+
+    int pending = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t cluster = clusters[i];
+        if (cluster < 2 || cluster >= clusterLimit || cacheLookup(cluster) != -1)
+            continue;
+        int32_t index = cacheClaimSlot();
+        if (index == -1)
+            break;
+        CacheEntry *entry = &cacheEntries[index];
+        entry->cluster = cluster;
+        entry->dirty = false;
+        entry->metadata = false;
+        memset(entry->dirtySectors, 0, sizeof(entry->dirtySectors));
+        entry->referenced = true;
+        entry->loading = true;
+        uint32_t bucket = cluster % cacheBucketCount;
+        entry->next = cacheBuckets[bucket];
+        cacheBuckets[bucket] = index;
+        results[pending] = -1;
+        slots[pending++] = index;
+    }
+
+    if (pending)
+        transferCacheSlots(slots, pending, false, results);
+    for (int i = 0; i < pending; i++)
+    {
+        cacheEntries[slots[i]].loading = false;
+        if (results[i] != 0)
+            cacheUnlink(slots[i]); // Drop what failed, a later access retries it
+    }
+    free(slots);
+    free(results);
+}
+
+int readClusterRun(uint32_t cluster, uint32_t count, uint8_t *buffer)
+{
+    // Cached clusters (readahead, or dirty and newer than the disk) come from the cache,
+    // each stretch of the rest is one read
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t i = 0;
+    while (i < count)
+    {
+        int32_t index = cacheLookup(cluster + i);
+        if (index != -1 && !cacheEntries[index].loading)
+        {
+            cacheEntries[index].referenced = true;
+            memcpy(buffer + (size_t)i * clusterSize, cacheEntries[index].data, clusterSize);
+            i++;
+            continue;
+        }
+        uint32_t missStart = i++;
+        while (i < count && cacheLookup(cluster + i) == -1)
+            i++;
+        IoRequest request = {0};
+        request.buffer = buffer + (size_t)missStart * clusterSize;
+        request.length = (size_t)(i - missStart) * clusterSize;
+        request.offset = (off_t)clusterToSector(cluster + missStart) * bs.bytesPerSector;
+        if (ioTransfer(&request) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+uint32_t collectChain(uint32_t cluster, uint32_t *clusters, uint32_t max)
+{
+    uint32_t count = 0;
+    while (cluster >= 2 && cluster < 0x0FFFFFF8 && count < max)
+    {
+        clusters[count++] = cluster;
+        cluster = readFATEntry(cluster);
+    }
+    return count;
+}
+
+void readCluster(uint32_t clusterNumber, uint8_t *buffer)
+{
+    uint8_t *data = cacheGetCluster(clusterNumber);
+    if (!data)
+    {
+        printf("Failed to read cluster %u\n", clusterNumber);
+        return;
+    }
+    memcpy(buffer, data, bs.bytesPerSector * bs.sectorsPerCluster);
+}
+
+uint32_t readFATEntry(uint32_t clusterNumber)
+{
+    if (clusterNumber >= fatEntryCount)
+    {
+        fprintf(stderr, "FAT entry out of range: %u\n", clusterNumber);
+        return 0x0FFFFFFF; // Treat as end of chain so walks terminate
+    }
+    return fatTable[clusterNumber] & 0x0FFFFFFF; // Mask to get 28 bits
+}
+
+dentry_t *findDirEntry(uint32_t dirCluster, const char *name, uint32_t *entryCluster)
+{
+    uint8_t fatName[11];
+    if (!resolveShortName(dirCluster, name, fatName))
+        return NULL; // No such long name
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        uint32_t cluster, slot;
+        DentryCacheEntry *cached = dentryCacheLookup(dirCluster, fatName);
+        if (cached)
+        {
+            if (!cached->found)
+                return NULL; // Known miss, no directory access at all
+            cluster = cached->cluster;
+            slot = cached->slot;
+        }
+        else
+        {
+            bool found = locateDirEntry(dirCluster, fatName, &cluster, &slot);
+            dentryCacheStore(dirCluster, fatName, found, cluster, slot);
+            if (!found)
+                return NULL;
+        }
+
+        uint8_t *data = cacheGetCluster(cluster);
+        if (!data)
+            return NULL;
+        dentry_t *dentry = (dentry_t *)data + slot;
+        if (memcmp(dentry->DIR_Name, fatName, 11) == 0)
+        {
+            if (entryCluster)
+                *entryCluster = cluster;
+            return dentry; // Points into the cache, valid until the next cache access
+        }
+        // The directory changed behind the caches, drop what they hold and look again
+        dentryCacheForgetDirectory(dirCluster);
+        dirIndexInvalidate(dirCluster);
+    }
+    return NULL;
+}
+
+bool locateDirEntry(uint32_t dirCluster, const uint8_t *fatName, uint32_t *entryCluster, uint32_t *entrySlot)
+{
+    DirIndex *index = dirIndexGet(dirCluster);
+    if (index)
+    {
+        DirIndexEntry *hit = dirIndexFind(index, fatName);
+        if (!hit)
+            return false;
+        *entryCluster = hit->cluster;
+        *entrySlot = hit->slot;
+        return true;
+    }
+
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    uint32_t cluster = dirCluster;
+    do
+    {
+        uint8_t *data = cacheGetCluster(cluster);
+        if (!data)
+            return false;
+        dentry_t *dentry = (dentry_t *)data;
+        for (uint32_t i = 0; i < entriesPerCluster; i++, dentry++)
+        {
+            if (dentry->DIR_Name[0] == 0x00)
+                return false; // End of directory
+            if ((uint8_t)dentry->DIR_Name[0] == 0xE5 || (dentry->DIR_Attr & 0x0F) == 0x0F)
+                continue; // Skip deleted entries and long name pieces
+            if (memcmp(dentry->DIR_Name, fatName, 11) == 0)
+            {
+                *entryCluster = cluster;
+                *entrySlot = i;
+                return true;
+            }
+        }
+        cluster = readFATEntry(cluster);
+    } while (cluster < 0x0FFFFFF8);
+    return false;
+}
+
+DentryCacheEntry *dentryCacheSlot(uint32_t dirCluster, const uint8_t *fatName)
+{
+    uint32_t hash = dirIndexHash(fatName) ^ (dirCluster * 2654435761u);
+    return &dentryCache[hash % DENTRY_CACHE_SIZE];
+}
+
+DentryCacheEntry *dentryCacheLookup(uint32_t dirCluster, const uint8_t *fatName)
+{
+    DentryCacheEntry *entry = dentryCacheSlot(dirCluster, fatName);
+    if (entry->dirCluster == dirCluster && memcmp(entry->name, fatName, 11) == 0)
+        return entry;
+    return NULL;
+}
+
+void dentryCacheStore(uint32_t dirCluster, const uint8_t *fatName, bool found, uint32_t cluster, uint32_t slot)
+{
+    // Direct mapped: a colliding lookup simply replaces the older one
+    DentryCacheEntry *entry = dentryCacheSlot(dirCluster, fatName);
+    entry->dirCluster = dirCluster;
+    memcpy(entry->name, fatName, 11);
+    entry->found = found;
+    entry->cluster = found ? cluster : 0;
+    entry->slot = found ? slot : 0;
+}
+
+void dentryCacheForget(uint32_t dirCluster, const uint8_t *fatName)
+{
+    DentryCacheEntry *entry = dentryCacheLookup(dirCluster, fatName);
+    if (entry)
+        entry->dirCluster = 0;
+}
+
+void dentryCacheForgetDirectory(uint32_t dirCluster)
+{
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+    {
+        if (dentryCache[i].dirCluster == dirCluster)
+            dentryCache[i].dirCluster = 0;
+    }
+}
+
+void dentryCacheReset()
+{
+    memset(dentryCache, 0, sizeof(dentryCache));
+}
+
+uint32_t dirIndexHash(const uint8_t *name)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++)
+    {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+DirIndexEntry *dirIndexFind(DirIndex *index, const uint8_t *name)
+{
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = dirIndexHash(name) & mask;; i = (i + 1) & mask)
+    {
+        DirIndexEntry *entry = &index->table[i];
+        if (entry->state == DIR_INDEX_EMPTY)
+            return NULL;
+        if (entry->state == DIR_INDEX_USED && memcmp(entry->name, name, 11) == 0)
+            return entry;
+    }
+}
+
+bool dirIndexResize(DirIndex *index, uint32_t capacity)
+{
+    DirIndexEntry *table = calloc(capacity, sizeof(DirIndexEntry));
+    if (!table)
+        return false;
+    DirIndexEntry *old = index->table;
+    uint32_t oldCapacity = index->capacity;
+    index->table = table;
+    index->capacity = capacity;
+    index->used = 0;
+    // Rehashing also drops the tombstones
+    for (uint32_t i = 0; i < oldCapacity; i++)
+    {
+        if (old[i].state == DIR_INDEX_USED)
+            dirIndexInsert(index, old[i].name, old[i].cluster, old[i].slot);
+    }
+    free(old);
+    return true;
+}
+
+bool dirIndexInsert(DirIndex *index, const uint8_t *name, uint32_t cluster, uint32_t slot)
+{
+    // Keep the load under a half so probe runs stay short
+    if ((index->used + 1) * 2 > index->capacity && !dirIndexResize(index, index->capacity * 2))
+        return false;
+    uint32_t mask = index->capacity - 1;
+    DirIndexEntry *target = NULL;
+    for (uint32_t i = dirIndexHash(name) & mask;; i = (i + 1) & mask)
+    {
+        DirIndexEntry *entry = &index->table[i];
+        if (entry->state == DIR_INDEX_USED && memcmp(entry->name, name, 11) == 0)
+            return true; // A scan finds the first of duplicate names, keep that one
+        if (entry->state == DIR_INDEX_DELETED && !target)
+            target = entry;
+        if (entry->state == DIR_INDEX_EMPTY)
+        {
+            if (!target)
+            {
+                target = entry;
+                index->used++;
+            }
+            break;
+        }
+    }
+    memcpy(target->name, name, 11);
+    target->state = DIR_INDEX_USED;
+    target->cluster = cluster;
+    target->slot = slot;
+    return true;
+}
+
+bool dirIndexAppendChain(DirIndex *index, uint32_t cluster)
+{
+    if (index->chainCount == index->chainCapacity)
+    {
+        uint32_t capacity = index->chainCapacity ? index->chainCapacity * 2 : 8;
+        uint32_t *grown = realloc(index->chain, capacity * sizeof(uint32_t));
+        if (!grown)
+            return false;
+        index->chain = grown;
+        index->chainCapacity = capacity;
+    }
+    index->chain[index->chainCount++] = cluster;
+    return true;
+}
+
+void dirIndexFree(DirIndex *index)
+{
+    for (uint32_t i = 0; i < index->longCapacity; i++)
+    {
+        free(index->longTable[i].name);
+    }
+    free(index->longTable);
+    free(index->chain);
+    free(index->table);
+    memset(index, 0, sizeof(DirIndex));
+}
+
+bool dirIndexBuild(DirIndex *index, uint32_t dirCluster)
+{
+    index->dirCluster = dirCluster;
+    index->capacity = DIR_INDEX_MIN_CAPACITY;
+    index->table = calloc(index->capacity, sizeof(DirIndexEntry));
+    if (!index->table)
+        return false;
+
+    // One pass over the directory, read in a single batch
+    uint32_t chain[PREFETCH_MAX_CLUSTERS];
+    cachePrefetch(chain, collectChain(dirCluster, chain, PREFETCH_MAX_CLUSTERS));
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    bool ended = false, freeFound = false;
+    LfnState lfn;
+    lfnReset(&lfn);
+    for (uint32_t cluster = dirCluster; cluster >= 2 && cluster < 0x0FFFFFF8; cluster = readFATEntry(cluster))
+    {
+        if (!dirIndexAppendChain(index, cluster))
+            return false;
+        if (ended)
+            continue; // Past the end marker, only the chain is still needed
+        dentry_t *dentry = (dentry_t *)cacheGetCluster(cluster);
+        if (!dentry)
+            return false;
+        for (uint32_t i = 0; i < entriesPerCluster; i++, dentry++)
+        {
+            if (dentry->DIR_Name[0] == 0x00 || (uint8_t)dentry->DIR_Name[0] == 0xE5)
+            {
+                if (!freeFound)
+                {
+                    index->freePos = index->chainCount - 1;
+                    index->freeSlot = i;
+                    freeFound = true;
+                }
+                lfnReset(&lfn);
+                if (dentry->DIR_Name[0] != 0x00)
+                {
+                    index->tombstones++;
+                    continue;
+                }
+                index->endPos = index->chainCount - 1;
+                index->endSlot = i;
+                ended = true;
+                break;
+            }
+            if ((dentry->DIR_Attr & 0x0F) == ATTR_LONG_NAME)
+            {
+                lfnAccept(&lfn, (uint8_t *)dentry); // Assembled once here, never on lookup
+                continue;
+            }
+            if (!dirIndexInsert(index, (uint8_t *)dentry->DIR_Name, cluster, i))
+                return false;
+            char longName[LFN_NAME_BUFFER];
+            if (lfnFinish(&lfn, (uint8_t *)dentry->DIR_Name, longName, sizeof(longName)) &&
+                !dirIndexInsertLong(index, longName, (uint8_t *)dentry->DIR_Name))
+                return false;
+        }
+    }
+    if (!ended)
+    {
+        index->endPos = index->chainCount;
+        index->endSlot = 0;
+    }
+    if (!freeFound)
+    {
+        index->freePos = index->chainCount;
+        index->freeSlot = 0;
+    }
+    return true;
+}
+
+DirIndex *dirIndexGet(uint32_t dirCluster)
+{
+    DirIndex *victim = &dirIndexes[0];
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        if (dirIndexes[i].dirCluster == dirCluster)
+        {
+            dirIndexes[i].lastUse = ++dirIndexClock;
+            return &dirIndexes[i];
+        }
+        if (dirIndexes[i].lastUse < victim->lastUse)
+            victim = &dirIndexes[i];
+    }
+
+    // Not indexed yet: replace the least recently used index
+    dirIndexFree(victim);
+    if (!dirIndexBuild(victim, dirCluster))
+    {
+        dirIndexFree(victim);
+        return NULL; // Callers fall back to scanning
+    }
+    victim->lastUse = ++dirIndexClock;
+    return victim;
+}
+
+DirIndex *dirIndexForCluster(uint32_t cluster)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        for (uint32_t j = 0; dirIndexes[i].dirCluster != 0 && j < dirIndexes[i].chainCount; j++)
+        {
+            if (dirIndexes[i].chain[j] == cluster)
+                return &dirIndexes[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t dirIndexChainPosition(DirIndex *index, uint32_t cluster)
+{
+    for (uint32_t i = 0; i < index->chainCount; i++)
+    {
+        if (index->chain[i] == cluster)
+            return i;
+    }
+    return index->chainCount;
+}
+
+bool dirIndexFreeSlot(DirIndex *index, uint32_t *cluster, uint32_t *slot)
+{
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    // Everything before the hint is in use, so the search starts there and stops at the end marker
+    while (index->freePos < index->chainCount)
+    {
+        uint8_t *data = cacheGetCluster(index->chain[index->freePos]);
+        if (!data)
+            return false;
+        uint8_t first = data[index->freeSlot * ENTRY_SIZE];
+        if (first == 0x00 || first == 0xE5 ||
+            (index->freePos == index->endPos && index->freeSlot == index->endSlot))
+        {
+            *cluster = index->chain[index->freePos];
+            *slot = index->freeSlot;
+            return true;
+        }
+        if (++index->freeSlot == entriesPerCluster)
+        {
+            index->freeSlot = 0;
+            index->freePos++;
+        }
+    }
+    return false;
+}
+
+bool findFreeDirSlot(uint32_t dirCluster, uint32_t *cluster, uint32_t *slot)
+{
+    DirIndex *index = dirIndexGet(dirCluster);
+    if (index)
+        return dirIndexFreeSlot(index, cluster, slot);
+
+    // No index: scan the chain for a free or deleted entry
+    uint32_t clusterSize = bs.sectorsPerCluster * bs.bytesPerSector;
+    for (; dirCluster >= 2 && dirCluster < 0x0FFFFFF8; dirCluster = readFATEntry(dirCluster))
+    {
+        uint8_t *buffer = cacheGetCluster(dirCluster);
+        if (!buffer)
+            return false;
+        for (uint32_t i = 0; i < clusterSize; i += ENTRY_SIZE)
+        {
+            if (buffer[i] == 0x00 || buffer[i] == 0xE5)
+            {
+                *cluster = dirCluster;
+                *slot = i / ENTRY_SIZE;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool dirIndexFreeRun(DirIndex *index, uint32_t count, uint32_t *pos, uint32_t *slot)
+{
+    // Finds count contiguous free entries; false means the chain must grow first,
+    // with *pos and *slot at the start of the run that growing completes
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    uint32_t p = index->freePos, s = index->freeSlot, run = 0;
+    bool gap = false; // Until the first free entry, the hint can follow the scan
+    while (p < index->chainCount)
+    {
+        if (p == index->endPos && s == index->endSlot)
+        {
+            // Everything from the end marker on is free
+            if (run == 0)
+            {
+                *pos = p;
+                *slot = s;
+            }
+            return run + (index->chainCount - p) * entriesPerCluster - s >= count;
+        }
+        uint8_t *data = cacheGetCluster(index->chain[p]);
+        if (!data)
+            return false;
+        uint8_t first = data[s * ENTRY_SIZE];
+        if (first == 0x00 || first == 0xE5)
+        {
+            if (run++ == 0)
+            {
+                *pos = p;
+                *slot = s;
+            }
+            if (run == count)
+                return true;
+        }
+        else
+            run = 0;
+        gap = gap || run > 0;
+        if (++s == entriesPerCluster)
+        {
+            s = 0;
+            p++;
+        }
+        if (!gap)
+        {
+            index->freePos = p;
+            index->freeSlot = s;
+        }
+    }
+    if (run == 0)
+    {
+        *pos = index->chainCount;
+        *slot = 0;
+    }
+    return false;
+}
+
+void dirIndexNoteSlotUsed(DirIndex *index, uint32_t pos, uint32_t slot, bool reused)
+{
+    if (reused && index->tombstones > 0)
+        index->tombstones--;
+    // Filling the end marker, or anything past it, moves it beyond that entry
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    if (pos > index->endPos || (pos == index->endPos && slot >= index->endSlot))
+    {
+        index->endPos = pos;
+        index->endSlot = slot + 1;
+        if (index->endSlot == entriesPerCluster)
+        {
+            index->endSlot = 0;
+            index->endPos++;
+        }
+    }
+}
+
+void dirIndexNoteFreed(DirIndex *index, uint32_t pos, uint32_t slot)
+{
+    index->tombstones++;
+    // A tombstone before the hint becomes the first free entry
+    if (pos < index->freePos || (pos == index->freePos && slot < index->freeSlot))
+    {
+        index->freePos = pos;
+        index->freeSlot = slot;
+    }
+}
+
+void dirIndexNoteAdd(uint32_t cluster, uint32_t slot, const uint8_t *name, bool reused)
+{
+    DirIndex *index = dirIndexForCluster(cluster);
+    if (!index)
+        return;
+    if (!dirIndexInsert(index, name, cluster, slot))
+    {
+        dirIndexFree(index); // Rebuilt on the next lookup
+        return;
+    }
+    dirIndexNoteSlotUsed(index, dirIndexChainPosition(index, cluster), slot, reused);
+}
+
+void dirIndexNoteRemove(uint32_t cluster, const uint8_t *name)
+{
+    DirIndex *index = dirIndexForCluster(cluster);
+    if (!index)
+        return;
+    DirIndexEntry *entry = dirIndexFind(index, name);
+    if (!entry)
+        return;
+    entry->state = DIR_INDEX_DELETED;
+    dirIndexNoteFreed(index, dirIndexChainPosition(index, entry->cluster), entry->slot);
+}
+
+void dirIndexNoteGrow(uint32_t lastCluster, uint32_t newCluster)
+{
+    // A full chain's hints already point at the start of the new cluster
+    DirIndex *index = dirIndexForCluster(lastCluster);
+    if (index && !dirIndexAppendChain(index, newCluster))
+        dirIndexFree(index);
+}
+
+void dirIndexInvalidate(uint32_t dirCluster)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        if (dirIndexes[i].dirCluster == dirCluster)
+            dirIndexFree(&dirIndexes[i]);
+    }
+}
+
+void dirIndexReset()
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        dirIndexFree(&dirIndexes[i]);
+    }
+    dirIndexClock = 0;
+}
+
+uint32_t longNameHash(const char *name)
+{
+    // Folded to upper case, long names compare without regard to case
+    uint32_t hash = 2166136261u;
+    for (; *name; name++)
+    {
+        hash ^= (uint8_t)toupper((unsigned char)*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+LongNameEntry *dirIndexFindLong(DirIndex *index, const char *name)
+{
+    if (index->longCapacity == 0)
+        return NULL;
+    uint32_t mask = index->longCapacity - 1;
+    for (uint32_t i = longNameHash(name) & mask;; i = (i + 1) & mask)
+    {
+        LongNameEntry *entry = &index->longTable[i];
+        if (entry->state == DIR_INDEX_EMPTY)
+            return NULL;
+        if (entry->state == DIR_INDEX_USED && strcasecmp(entry->name, name) == 0)
+            return entry;
+    }
+}
+
+bool dirIndexResizeLong(DirIndex *index, uint32_t capacity)
+{
+    LongNameEntry *table = calloc(capacity, sizeof(LongNameEntry));
+    if (!table)
+        return false;
+    LongNameEntry *old = index->longTable;
+    uint32_t oldCapacity = index->longCapacity;
+    index->longTable = table;
+    index->longCapacity = capacity;
+    index->longUsed = 0;
+    // The names move to the new table, only the tombstones are dropped
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = 0; i < oldCapacity; i++)
+    {
+        if (old[i].state != DIR_INDEX_USED)
+            continue;
+        uint32_t j = longNameHash(old[i].name) & mask;
+        while (table[j].state != DIR_INDEX_EMPTY)
+            j = (j + 1) & mask;
+        table[j] = old[i];
+        index->longUsed++;
+    }
+    free(old);
+    return true;
+}
+
+bool dirIndexInsertLong(DirIndex *index, const char *name, const uint8_t *shortName)
+{
+    if (index->longCapacity == 0 && !dirIndexResizeLong(index, DIR_INDEX_MIN_CAPACITY))
+        return false;
+    if ((index->longUsed + 1) * 2 > index->longCapacity && !dirIndexResizeLong(index, index->longCapacity * 2))
+        return false;
+    uint32_t mask = index->longCapacity - 1;
+    LongNameEntry *target = NULL;
+    for (uint32_t i = longNameHash(name) & mask;; i = (i + 1) & mask)
+    {
+        LongNameEntry *entry = &index->longTable[i];
+        if (entry->state == DIR_INDEX_USED && strcasecmp(entry->name, name) == 0)
+            return true; // A scan finds the first of duplicate names, keep that one
+        if (entry->state == DIR_INDEX_DELETED && !target)
+            target = entry;
+        if (entry->state == DIR_INDEX_EMPTY)
+        {
+            if (!target)
+            {
+                target = entry;
+                index->longUsed++;
+            }
+            break;
+        }
+    }
+    target->name = strdup(name);
+    if (!target->name)
+    {
+        target->state = DIR_INDEX_DELETED;
+        return false;
+    }
+    memcpy(target->shortName, shortName, 11);
+    target->state = DIR_INDEX_USED;
+    return true;
+}
+
+void dirIndexRemoveLong(DirIndex *index, const char *name)
+{
+    LongNameEntry *entry = dirIndexFindLong(index, name);
+    if (!entry)
+        return;
+    free(entry->name);
+    entry->name = NULL;
+    entry->state = DIR_INDEX_DELETED;
+}
+
+uint8_t lfnChecksum(const uint8_t *shortName)
+{
+    // Every long name piece carries this, tying it to its short entry
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + shortName[i]);
+    }
+    return sum;
+}
+
+// Byte offsets of the 13 UCS-2 characters inside a long name entry
+const uint8_t lfnCharOffsets[LFN_CHARS_PER_ENTRY] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+void lfnReset(LfnState *state)
+{
+    state->valid = false;
+    state->count = 0;
+    state->next = 0;
+}
+
+void lfnPlace(uint16_t *chars, const uint8_t *entry)
+{
+    uint32_t start = ((entry[0] & 0x1F) - 1) * LFN_CHARS_PER_ENTRY;
+    for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++)
+    {
+        chars[start + i] = entry[lfnCharOffsets[i]] | (entry[lfnCharOffsets[i] + 1] << 8);
+    }
+}
+
+void lfnAccept(LfnState *state, const uint8_t *entry)
+{
+    uint8_t ordinal = entry[0] & 0x1F;
+    if (entry[0] & LFN_LAST_ENTRY)
+    {
+        // Pieces are stored last first, this one starts a new sequence
+        if (ordinal == 0 || ordinal > LFN_MAX_ENTRIES)
+        {
+            lfnReset(state);
+            return;
+        }
+        state->valid = true;
+        state->count = ordinal;
+        state->checksum = entry[13];
+    }
+    else if (!state->valid || ordinal == 0 || ordinal != state->next || entry[13] != state->checksum)
+    {
+        lfnReset(state);
+        return;
+    }
+    lfnPlace(state->chars, entry);
+    state->next = ordinal - 1;
+}
+
+bool lfnFinish(LfnState *state, const uint8_t *shortName, char *out, size_t size)
+{
+    bool complete = state->valid && state->next == 0 && lfnChecksum(shortName) == state->checksum;
+    if (complete)
+        lfnDecode(state->chars, state->count * LFN_CHARS_PER_ENTRY, out, size);
+    lfnReset(state);
+    return complete && out[0] != '\0';
+}
+
+void lfnDecode(const uint16_t *chars, uint32_t count, char *out, size_t size)
+{
+    // UCS-2 to UTF-8, up to the terminator or the last piece
+    size_t used = 0;
+    for (uint32_t i = 0; i < count && chars[i] != 0x0000 && chars[i] != 0xFFFF; i++)
+    {
+        uint16_t c = chars[i];
+        int length = (c < 0x80) ? 1 : (c < 0x800) ? 2 : 3;
+        if (used + length >= size)
+            break;
+        if (length == 1)
+            out[used++] = (char)c;
+        else if (length == 2)
+        {
+            out[used++] = (char)(0xC0 | (c >> 6));
+            out[used++] = (char)(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            out[used++] = (char)(0xE0 | (c >> 12));
+            out[used++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[used++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    out[used] = '\0';
+}
+
+int lfnEncode(const char *name, uint16_t *chars)
+{
+    // UTF-8 to UCS-2; returns the length, or -1 when the name cannot be stored
+    int length = 0;
+    bool visible = false;
+    for (const unsigned char *p = (const unsigned char *)name; *p;)
+    {
+        uint16_t c;
+        if (*p < 0x80)
+            c = *p++;
+        else if ((*p & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80)
+        {
+            c = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        }
+        else if ((*p & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80)
+        {
+            c = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            p += 3;
+        }
+        else
+            return -1;
+        if (c < 0x20 || (c < 0x80 && strchr("\"*/:<>?\\|", c)) || length == LFN_MAX_CHARS)
+            return -1;
+        if (c != ' ' && c != '.')
+            visible = true;
+        chars[length++] = c;
+    }
+    return visible ? length : -1;
+}
+
+void lfnFillEntry(uint8_t *entry, const uint16_t *chars, int length, uint8_t ordinal, bool last, uint8_t checksum)
+{
+    memset(entry, 0, ENTRY_SIZE);
+    entry[0] = ordinal | (last ? LFN_LAST_ENTRY : 0);
+    entry[11] = ATTR_LONG_NAME;
+    entry[13] = checksum;
+    // The name ends with one 0x0000 and the rest of the piece is padded with 0xFFFF
+    for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++)
+    {
+        int index = (ordinal - 1) * LFN_CHARS_PER_ENTRY + i;
+        uint16_t c = (index < length) ? chars[index] : (index == length) ? 0x0000 : 0xFFFF;
+        entry[lfnCharOffsets[i]] = c & 0xFF;
+        entry[lfnCharOffsets[i] + 1] = c >> 8;
+    }
+}
+
+bool isShortName(const char *name)
+{
+    // Names a short entry holds as typed, apart from case, aliases like "LONGNA~1.TXT" included
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return true;
+    const char *dot = strchr(name, '.');
+    size_t baseLength = dot ? (size_t)(dot - name) : strlen(name);
+    size_t extLength = dot ? strlen(dot + 1) : 0;
+    if (baseLength == 0 || baseLength > 8 || extLength > 3 || (dot && extLength == 0))
+        return false;
+    for (const char *p = name; *p; p++)
+    {
+        if (p != dot && shortAliasChar((unsigned char)*p) != toupper((unsigned char)*p))
+            return false;
+    }
+    return true;
+}
+
+bool isValidLongName(const char *name)
+{
+    uint16_t chars[LFN_MAX_CHARS];
+    return lfnEncode(name, chars) > 0;
+}
+
+char shortAliasChar(unsigned char c)
+{
+    if (isalnum(c) && c < 0x80)
+        return toupper(c);
+    if (c < 0x80 && strchr("$%'-_@~`!(){}^#&", c))
+        return c;
+    return '_'; // Anything a short name cannot hold
+}
+
+bool makeShortAlias(uint32_t dirCluster, const char *longName, uint8_t *alias)
+{
+    // Basis name: upper case, spaces and inner dots dropped, extension from the last dot
+    const char *dot = strrchr(longName, '.');
+    if (dot == longName)
+        dot = NULL;
+    char base[8], ext[3];
+    int baseLength = 0, extLength = 0;
+    for (const char *p = longName; *p && p != dot; p++)
+    {
+        if (*p != ' ' && *p != '.' && baseLength < 8)
+            base[baseLength++] = shortAliasChar((unsigned char)*p);
+    }
+    for (const char *p = dot ? dot + 1 : ""; *p; p++)
+    {
+        if (*p != ' ' && *p != '.' && extLength < 3)
+            ext[extLength++] = shortAliasChar((unsigned char)*p);
+    }
+
+    // "~1" to "~4" first; after that, as Windows does, two basis characters and
+    // four hex digits from a hash of the long name, so crowded prefixes stay cheap
+    uint32_t hash = longNameHash(longName);
+    for (uint32_t n = 1; n < 1000000; n++)
+    {
+        char tail[9];
+        int tailLength = (n <= 4) ? snprintf(tail, sizeof(tail), "~%u", n)
+                                  : snprintf(tail, sizeof(tail), "%04X~1", (hash + n) & 0xFFFF);
+        int keep = (baseLength < 8 - tailLength) ? baseLength : 8 - tailLength;
+        memset(alias, ' ', 11);
+        memcpy(alias, base, keep);
+        memcpy(alias + keep, tail, tailLength);
+        memcpy(alias + 8, ext, extLength);
+        uint32_t cluster, slot;
+        if (!locateDirEntry(dirCluster, alias, &cluster, &slot))
+            return true;
+    }
+    return false;
+}
+
+bool resolveShortName(uint32_t dirCluster, const char *name, uint8_t *fatName)
+{
+    if (isShortName(name))
+    {
+        formatNameToFAT(name, fatName);
+        return true;
+    }
+    // Long names map to their alias through the index, no LFN parsing per lookup
+    DirIndex *index = dirIndexGet(dirCluster);
+    if (!index)
+        return scanLongName(dirCluster, name, fatName);
+    LongNameEntry *hit = dirIndexFindLong(index, name);
+    if (!hit)
+        return false;
+    memcpy(fatName, hit->shortName, 11);
+    return true;
+}
+
+bool scanLongName(uint32_t dirCluster, const char *name, uint8_t *fatName)
+{
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    LfnState state;
+    lfnReset(&state);
+    for (uint32_t cluster = dirCluster; cluster >= 2 && cluster < 0x0FFFFFF8; cluster = readFATEntry(cluster))
+    {
+        uint8_t *data = cacheGetCluster(cluster);
+        if (!data)
+            return false;
+        for (uint32_t i = 0; i < entriesPerCluster; i++)
+        {
+            uint8_t *entry = data + i * ENTRY_SIZE;
+            if (entry[0] == 0x00)
+                return false; // End of directory
+            if (entry[0] == 0xE5)
+                lfnReset(&state);
+            else if ((entry[11] & 0x0F) == ATTR_LONG_NAME)
+                lfnAccept(&state, entry);
+            else
+            {
+                char longName[LFN_NAME_BUFFER];
+                if (lfnFinish(&state, entry, longName, sizeof(longName)) && strcasecmp(longName, name) == 0)
+                {
+                    memcpy(fatName, entry, 11);
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+int writeLongDirectoryEntry(uint32_t parentCluster, const char *name, uint32_t cluster, uint8_t attr)
+{
+    uint16_t chars[LFN_MAX_CHARS];
+    int length = lfnEncode(name, chars);
+    uint8_t alias[11];
+    if (length <= 0 || !makeShortAlias(parentCluster, name, alias))
+    {
+        printf("Error: No short alias available for '%s'.\n", name);
+        return -1;
+    }
+    dentryCacheForget(parentCluster, alias);
+
+    // The long name pieces and their short entry must be contiguous
+    uint32_t pieces = (length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+    uint32_t pos, slot;
+    DirIndex *index = dirIndexGet(parentCluster);
+    while (index && !dirIndexFreeRun(index, pieces + 1, &pos, &slot))
+    {
+        if (expandDirectory(parentCluster) == -1)
+            return -1;
+        index = dirIndexGet(parentCluster);
+    }
+    if (!index)
+    {
+        printf("Error indexing directory cluster %u\n", parentCluster);
+        return -1;
+    }
+
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    uint8_t checksum = lfnChecksum(alias);
+    for (uint32_t k = 0; k <= pieces; k++)
+    {
+        uint32_t entryCluster = index->chain[pos];
+        uint8_t *data = cacheGetCluster(entryCluster);
+        if (!data)
+        {
+            printf("Error reading directory cluster %u\n", entryCluster);
+            return -1;
+        }
+        uint8_t *entry = data + slot * ENTRY_SIZE;
+        bool reused = entry[0] == 0xE5;
+        if (k < pieces)
+        {
+            lfnFillEntry(entry, chars, length, pieces - k, k == 0, checksum); // Last piece first
+            cacheMarkEntry(entryCluster, (dentry_t *)entry);
+            dirIndexNoteSlotUsed(index, pos, slot, reused);
+        }
+        else
+        {
+            memset(entry, 0, ENTRY_SIZE);
+            memcpy(entry, alias, 11);
+            entry[11] = attr;
+            uint16_t hi = (cluster >> 16) & 0xFFFF;
+            uint16_t lo = cluster & 0xFFFF;
+            memcpy(entry + 20, &hi, sizeof(hi));
+            memcpy(entry + 26, &lo, sizeof(lo));
+            cacheMarkEntry(entryCluster, (dentry_t *)entry);
+            dirIndexNoteAdd(entryCluster, slot, entry, reused);
+            if (index->dirCluster == parentCluster && !dirIndexInsertLong(index, name, alias))
+                dirIndexFree(index); // Rebuilt on the next lookup
+        }
+        if (++slot == entriesPerCluster)
+        {
+            slot = 0;
+            pos++;
+        }
+    }
+    return 0;
+}
+
+void deleteLongNameEntries(uint32_t dirCluster, uint32_t entryCluster, uint32_t slot)
+{
+    DirIndex *index = dirIndexGet(dirCluster);
+    uint8_t *data = cacheGetCluster(entryCluster);
+    if (!index || !data)
+        return;
+    uint8_t checksum = lfnChecksum(data + slot * ENTRY_SIZE);
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    uint32_t pos = dirIndexChainPosition(index, entryCluster);
+
+    // Walk back from the short entry over pieces 1, 2, ... up to the one flagged last
+    uint16_t chars[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    uint8_t expected = 1;
+    while (expected <= LFN_MAX_ENTRIES && pos < index->chainCount && (pos > 0 || slot > 0))
+    {
+        if (slot-- == 0)
+        {
+            slot = entriesPerCluster - 1;
+            pos--;
+        }
+        data = cacheGetCluster(index->chain[pos]);
+        if (!data)
+            return;
+        uint8_t *entry = data + slot * ENTRY_SIZE;
+        if (entry[0] == 0xE5 || (entry[11] & 0x0F) != ATTR_LONG_NAME ||
+            entry[13] != checksum || (entry[0] & 0x1F) != expected)
+            return;
+        lfnPlace(chars, entry);
+        bool last = entry[0] & LFN_LAST_ENTRY;
+        entry[0] = 0xE5;
+        cacheMarkEntry(index->chain[pos], (dentry_t *)entry);
+        dirIndexNoteFreed(index, pos, slot);
+        if (last)
+        {
+            char name[LFN_NAME_BUFFER];
+            lfnDecode(chars, expected * LFN_CHARS_PER_ENTRY, name, sizeof(name));
+            dirIndexRemoveLong(index, name);
+            return;
+        }
+        expected++;
+    }
+}
+
+uint32_t parentDirectory(uint32_t dirCluster)
+{
+    if (dirCluster == bs.rootCluster)
+        return bs.rootCluster; // '..' of the root is the root
+    // '..' is always the second entry of a directory's first cluster
+    dentry_t *entry = (dentry_t *)cacheGetCluster(dirCluster);
+    if (!entry || !(entry[1].DIR_Attr & ATTR_DIRECTORY))
+        return 0;
+    uint32_t parent = ((uint32_t)entry[1].DIR_FstClusHI << 16) | entry[1].DIR_FstClusLO;
+    return parent ? parent : bs.rootCluster; // FAT stores 0 for a parent that is the root
+}
+
+uint32_t lookupDirectory(uint32_t dirCluster, const char *name)
+{
+    if (strcmp(name, ".") == 0 || name[0] == '\0')
+        return dirCluster;
+    if (strcmp(name, "..") == 0)
+        return parentDirectory(dirCluster);
+    dentry_t *entry = findDirEntry(dirCluster, name, NULL);
+    if (!entry || !(entry->DIR_Attr & ATTR_DIRECTORY))
+        return 0;
+    uint32_t cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    return cluster ? cluster : bs.rootCluster;
+}
+
+int resolvePath(const char *path, uint32_t *dirCluster, char *leaf)
+{
+    // Absolute paths start at the root, everything else at the current directory
+    uint32_t cluster = (path[0] == '/') ? bs.rootCluster : currentDirectoryCluster;
+    const char *component = path;
+    while (true)
+    {
+        while (*component == '/')
+            component++;
+        const char *end = strchr(component, '/');
+        size_t length = end ? (size_t)(end - component) : strlen(component);
+        const char *rest = end;
+        while (rest && *rest == '/')
+            rest++;
+        if (length > MAX_NAME_LENGTH)
+            return -1;
+
+        char name[MAX_NAME_LENGTH + 1];
+        memcpy(name, component, length);
+        name[length] = '\0';
+        if (!end || *rest == '\0')
+        {
+            // Last component: the caller decides what it must be
+            strcpy(leaf, name);
+            *dirCluster = cluster;
+            return 0;
+        }
+        // Intermediate components must be directories, served from the lookup caches
+        cluster = lookupDirectory(cluster, name);
+        if (cluster == 0)
+            return -1;
+        component = rest;
+    }
+}
+
+uint32_t resolveDirectory(const char *path)
+{
+    uint32_t dirCluster;
+    char leaf[MAX_NAME_LENGTH + 1];
+    if (resolvePath(path, &dirCluster, leaf) != 0)
+        return 0;
+    return lookupDirectory(dirCluster, leaf);
+}
+
+int changeDirectory(const char *path)
+{
+    uint32_t target = resolveDirectory(path);
+    if (target == 0)
+        return -1;
+
+    // Replay the walk on the directory stack so the prompt shows the new path
+    if (path[0] == '/')
+    {
+        while (dirStack.size > 1)
+            free(popDir());
+    }
+    char *copy = strdup(path);
+    char *state = NULL;
+    for (char *name = strtok_r(copy, "/", &state); name; name = strtok_r(NULL, "/", &state))
+    {
+        if (strcmp(name, ".") == 0)
+            continue;
+        if (strcmp(name, "..") == 0)
+        {
+            if (dirStack.size > 1)
+                free(popDir());
+            continue;
+        }
+        pushDir(name, lookupDirectory(dirStack.clusterNumber[dirStack.size - 1], name));
+    }
+    free(copy);
+    currentDirectoryCluster = target;
+    return 0;
+}
+
+void dbg_print_dentry(dentry_t *dentry)
+{
+    if (dentry == NULL)
+    {
+        return;
+    }
+    printf("DIR_Name: %s\n", dentry->DIR_Name);
+    printf("DIR_Attr: 0x%x\n", dentry->DIR_Attr);
+    printf("DIR_FstClusHI: 0x%x\n", dentry->DIR_FstClusHI);
+    printf("DIR_FstClusLO: 0x%x\n", dentry->DIR_FstClusLO);
+    printf("DIR_FileSize: %u\n", dentry->DIR_FileSize);
+}
+void dirIterOpen(DirIterator *iter, uint32_t dirCluster)
+{
+    iter->cluster = dirCluster;
+    iter->slot = 0;
+    iter->prefetched = 0;
+    lfnReset(&iter->lfn);
+}
+
+bool dirIterNext(DirIterator *iter, DirEntryInfo *info)
+{
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t);
+    while (iter->cluster >= 2 && iter->cluster < 0x0FFFFFF8)
+    {
+        if (iter->slot == entriesPerCluster)
+        {
+            iter->cluster = readFATEntry(iter->cluster);
+            iter->slot = 0;
+            continue;
+        }
+        if (iter->slot == 0 && iter->prefetched-- == 0)
+        {
+            // Load the chain ahead in batches, so memory stays bounded for any directory size
+            uint32_t chain[PREFETCH_MAX_CLUSTERS];
+            iter->prefetched = collectChain(iter->cluster, chain, PREFETCH_MAX_CLUSTERS);
+            cachePrefetch(chain, iter->prefetched);
+            iter->prefetched--;
+        }
+        uint8_t *data = cacheGetCluster(iter->cluster);
+        if (!data)
+        {
+            printf("Failed to read directory cluster %u\n", iter->cluster);
+            break;
+        }
+        dentry_t *entry = (dentry_t *)data + iter->slot++;
+        if (entry->DIR_Name[0] == 0x00)
+            break; // End of directory
+        if ((uint8_t)entry->DIR_Name[0] == 0xE5)
+        {
+            lfnReset(&iter->lfn);
+            continue;
+        }
+        if ((entry->DIR_Attr & 0x0F) == ATTR_LONG_NAME)
+        {
+            lfnAccept(&iter->lfn, (uint8_t *)entry); // Collect the pieces of the next entry's long name
+            continue;
+        }
+
+        memcpy(info->shortName, entry->DIR_Name, 11);
+        if (!lfnFinish(&iter->lfn, info->shortName, info->name, sizeof(info->name)))
+            shortNameToString(info->shortName, info->name);
+        info->attr = entry->DIR_Attr;
+        info->size = entry->DIR_FileSize;
+        info->firstCluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+        return true;
+    }
+    iter->cluster = 0x0FFFFFFF;
+    return false;
+}
+
+void shortNameToString(const uint8_t *shortName, char *out)
+{
+    // "README  TXT" becomes "README.TXT"
+    int length = 0;
+    for (int i = 0; i < 8 && shortName[i] != ' '; i++)
+        out[length++] = shortName[i];
+    if (shortName[8] != ' ')
+    {
+        out[length++] = '.';
+        for (int i = 8; i < 11 && shortName[i] != ' '; i++)
+            out[length++] = shortName[i];
+    }
+    out[length] = '\0';
+}
+
+bool outInit(OutputBuffer *out, size_t capacity)
+{
+    out->data = malloc(capacity);
+    out->used = 0;
+    out->capacity = out->data ? capacity : 0;
+    return out->data != NULL;
+}
+
+void outPrintf(OutputBuffer *out, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t space = out->capacity - out->used;
+    int length = vsnprintf(out->data + out->used, space, format, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    if ((size_t)length >= space)
+    {
+        // Did not fit: drain the buffer and format again into the empty one
+        outFlush(out);
+        va_start(args, format);
+        if ((size_t)length < out->capacity)
+            vsnprintf(out->data, out->capacity, format, args);
+        else
+            vprintf(format, args); // Longer than the whole buffer
+        va_end(args);
+        if ((size_t)length >= out->capacity)
+        {
+            fflush(stdout);
+            return;
+        }
+    }
+    out->used += length;
+}
+
+void outFlush(OutputBuffer *out)
+{
+    writeOutput(out->data, out->used);
+    out->used = 0;
+}
+
+bool writeOutputv(struct iovec *iov, int count)
+{
+    fflush(stdout); // Whatever printf still holds goes first
+    while (count > 0)
+    {
+        ssize_t n = writev(STDOUT_FILENO, iov, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        // Drop what went out, a short write can stop inside a piece
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool writeOutput(const void *data, size_t length)
+{
+    struct iovec iov = {(void *)data, length};
+    return writeOutputv(&iov, 1);
+}
+
+bool queueOutput(struct iovec *pending, int *pendingCount, const uint8_t *data, size_t length)
+{
+    // Pieces that continue the previous one in memory join it
+    if (*pendingCount > 0)
+    {
+        struct iovec *last = &pending[*pendingCount - 1];
+        if ((uint8_t *)last->iov_base + last->iov_len == data)
+        {
+            last->iov_len += length;
+            return true;
+        }
+    }
+    if (*pendingCount == READ_IOV_BATCH)
+    {
+        bool written = writeOutputv(pending, *pendingCount);
+        *pendingCount = 0;
+        if (!written)
+            return false;
+    }
+    pending[(*pendingCount)++] = (struct iovec){(void *)data, length};
+    return true;
+}
+
+void outFree(OutputBuffer *out)
+{
+    outFlush(out);
+    free(out->data);
+    out->data = NULL;
+    out->capacity = 0;
+}
+
+void listDirectory(uint32_t cluster, bool longFormat, uint32_t offset, uint32_t limit)
+{
+    printf("Listing directory at cluster: %d\n", cluster);
+    OutputBuffer out;
+    if (!outInit(&out, OUTPUT_BUFFER_SIZE))
+    {
+        printf("Failed to allocate the listing buffer.\n");
+        return;
+    }
+
+    DirIterator iter;
+    DirEntryInfo info;
+    dirIterOpen(&iter, cluster);
+    uint32_t index = 0, shown = 0;
+    while (dirIterNext(&iter, &info))
+    {
+        if (index++ < offset)
+            continue;
+        if (limit && shown == limit)
+        {
+            outPrintf(&out, "%s-- more entries, continue with --offset %u --\n", (!longFormat && shown % LS_COLUMNS) ? "\n" : "", index - 1);
+            shown = 0; // The line is already closed
+            break;
+        }
+        shown++;
+        if (longFormat)
+        {
+            outPrintf(&out, "%c%c%c%c%c %10u %10u  %s\n",
+                      (info.attr & ATTR_DIRECTORY) ? 'd' : '-', (info.attr & 0x01) ? 'r' : '-',
+                      (info.attr & 0x02) ? 'h' : '-', (info.attr & 0x04) ? 's' : '-',
+                      (info.attr & 0x20) ? 'a' : '-', info.size, info.firstCluster, info.name);
+        }
+        else
+        {
+            outPrintf(&out, "%-11s %s", info.name, (shown % LS_COLUMNS) ? "" : "\n");
+        }
+    }
+    if (!longFormat && shown % LS_COLUMNS)
+        outPrintf(&out, "\n");
+    outFree(&out);
+}
+
+int createDirEntry(uint32_t parentCluster, const char *dirName)
+{
+    uint32_t dirCluster = allocateCluster();
+    if (dirCluster == 0)
+    {
+        printf("Failed to allocate a new cluster for the directory.\n");
+        return -1;
+    }
+    if (!writeDirectoryEntry(parentCluster, dirName, dirCluster, ATTR_DIRECTORY))
+    {
+        printf("Failed to create directory entry.\n");
+        return -1;
+    }
+    // Create entries for '.' and '..'
+    writeDirectoryEntry(dirCluster, ".", dirCluster, ATTR_DIRECTORY);    
+    writeDirectoryEntry(dirCluster, "..", parentCluster, ATTR_DIRECTORY); 
+    return 0;                                                            
+}
+
+void formatNameToFAT(const char *name, uint8_t *entryBuffer)
+{
+    memset(entryBuffer, ' ', 11);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        memcpy(entryBuffer, name, strlen(name)); // Dot entries are stored literally
+        return;
+    }
+    // Copy the base name and extension into the buffer
+    int i = 0, j = 0;
+    for (; name[i] != '\0' && name[i] != '.' && i < 8; ++i)
+    {
+        entryBuffer[j++] = toupper((unsigned char)name[i]); //  only the first 8 characters(name) 
+    }
+    if (name[i] == '.')
+        ++i; 
+    j = 8;  
+    for (; name[i] != '\0' && j < 11; ++i)
+    {
+        entryBuffer[j++] = toupper((unsigned char)name[i]); 
+    }
+}
+
+int updateParentDirectory(uint32_t parentCluster, const char *dirName, uint32_t newCluster)
+{
+    if (writeDirectoryEntry(parentCluster, dirName, newCluster, ATTR_DIRECTORY) != 0)
+    {
+        printf("Failed to update parent directory with new directory entry.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void writeFATEntry(uint32_t clusterNumber, uint32_t value)
+{
+    if (clusterNumber >= fatEntryCount)
+    {
+        fprintf(stderr, "FAT entry out of range: %u\n", clusterNumber);
+        return;
+    }
+    // The top 4 bits are reserved and must be preserved
+    fatTable[clusterNumber] = (fatTable[clusterNumber] & 0xF0000000) | (value & 0x0FFFFFFF);
+    fatDirty[(clusterNumber * 4) / bs.bytesPerSector] = 1; // Written back on flushFAT()
+    setClusterFree(clusterNumber, (value & 0x0FFFFFFF) == 0);
+}
+
+int writeEntryToDisk(uint32_t parentCluster, const uint8_t *entry)
+{
+    dentryCacheForget(parentCluster, entry); // A cached miss for this name is about to be wrong
+    uint32_t entryCluster, slot;
+    if (!findFreeDirSlot(parentCluster, &entryCluster, &slot))
+    {
+        printf("Failed to find a free directory entry.\n");
+        return -1;
+    }
+    uint8_t *buffer = cacheGetCluster(entryCluster);
+    if (!buffer)
+    {
+        printf("Error reading directory cluster %u\n", entryCluster);
+        return -1;
+    }
+    bool reused = buffer[slot * ENTRY_SIZE] == 0xE5;
+    memcpy(buffer + slot * ENTRY_SIZE, entry, ENTRY_SIZE);
+    cacheMarkEntry(entryCluster, (dentry_t *)(buffer + slot * ENTRY_SIZE)); // Written back with the next flush
+    dirIndexNoteAdd(entryCluster, slot, entry, reused);
+    return 0;
+}
+
+uint32_t allocateCluster()
+{
+    uint32_t clusterNumber = findFreeCluster(nextFreeCursor);
+    if (clusterNumber == 0)
+    {
+        return 0;
+    }
+    writeFATEntry(clusterNumber, 0x0FFFFFFF);
+    nextFreeCursor = clusterNumber + 1; // Rotate so the next search starts past this one
+    return clusterNumber;
+}
+
+uint32_t allocateClusterBatch(uint32_t count, uint32_t *clusters)
+{
+    if (count > freeClusterTotal)
+        return 0; // All or nothing
+    // One forward pass over the free bitmap, each search resumes after the last hit
+    uint32_t cluster = nextFreeCursor;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        cluster = findFreeCluster(cluster);
+        writeFATEntry(cluster, 0x0FFFFFFF);
+        clusters[i] = cluster++;
+    }
+    nextFreeCursor = cluster;
+    return count;
+}
+
+int writeDirectoryEntry(uint32_t parentCluster, const char *name, uint32_t cluster, uint8_t attr)
+{
+    if (!isShortName(name))
+        return writeLongDirectoryEntry(parentCluster, name, cluster, attr);
+    uint8_t fatName[11];
+    formatNameToFAT(name, fatName);
+    dentryCacheForget(parentCluster, fatName); // A cached miss for this name is about to be wrong
+    uint32_t entryCluster, slot;
+    if (!findFreeDirSlot(parentCluster, &entryCluster, &slot))
+    {
+        // No free entry found, try to expand the directory
+        int newCluster = expandDirectory(parentCluster);
+        if (newCluster == -1)
+        {
+            return -1;
+        }
+        entryCluster = newCluster;
+        slot = 0;
+    }
+
+    uint8_t *buffer = cacheGetCluster(entryCluster);
+    if (!buffer)
+    {
+        printf("Error reading directory cluster %u\n", entryCluster);
+        return -1;
+    }
+    uint8_t *entry = buffer + slot * ENTRY_SIZE;
+    bool reused = entry[0] == 0xE5;
+    memset(entry, 0, ENTRY_SIZE); // A reused slot may still hold the deleted entry's fields
+    memcpy(entry, fatName, 11);
+    entry[11] = attr;
+    uint16_t hi = (cluster >> 16) & 0xFFFF;
+    uint16_t lo = cluster & 0xFFFF;
+    memcpy(entry + 20, &hi, sizeof(hi));
+    memcpy(entry + 26, &lo, sizeof(lo)); // File size stays 0 bytes -req
+    cacheMarkEntry(entryCluster, (dentry_t *)entry);
+    dirIndexNoteAdd(entryCluster, slot, entry, reused);
+    return 0;
+}
+
+int createDirectory(const char *dirName)
+{
+    printf("Attempting to create directory: %s\n", dirName);
+
+ 
+    uint32_t parentCluster;
+    char leaf[MAX_NAME_LENGTH + 1];
+    if (resolvePath(dirName, &parentCluster, leaf) != 0)
+    {
+        printf("Error: Parent directory of '%s' not found.\n", dirName);
+        return -1;
+    }
+    if (!is_8_3_format_directory(leaf) && !isValidLongName(leaf))
+    {
+        printf("Error: Directory name '%s' is not a valid FAT32 name.\n", leaf);
+        return -1;
+    }
+
+    if (findDirEntry(parentCluster, leaf, NULL) != NULL)
+    {
+        printf("Error: '%s' already exists.\n", dirName);
+        return -1;
+    }
+    // writeDirectoryEntry grows the parent itself when it has no free entry
+    return addDirectory(parentCluster, leaf);
+}
+
+int makeDirectories(const char *path)
+{
+    // mkdir -p: walk the path once, creating each missing component under its parent cluster
+    uint32_t cluster = (path[0] == '/') ? bs.rootCluster : currentDirectoryCluster;
+    const char *component = path;
+    while (true)
+    {
+        while (*component == '/')
+            component++;
+        if (*component == '\0')
+            return 0;
+        size_t length = strcspn(component, "/");
+        if (length > MAX_NAME_LENGTH)
+        {
+            printf("Error: A component of '%s' is too long.\n", path);
+            return -1;
+        }
+        char name[MAX_NAME_LENGTH + 1];
+        memcpy(name, component, length);
+        name[length] = '\0';
+        component += length;
+
+        uint32_t next = lookupDirectory(cluster, name);
+        if (next == 0)
+        {
+            if (findDirEntry(cluster, name, NULL) != NULL)
+            {
+                printf("Error: '%s' exists and is not a directory.\n", name);
+                return -1;
+            }
+            if (!is_8_3_format_directory(name) && !isValidLongName(name))
+            {
+                printf("Error: Directory name '%s' is not a valid FAT32 name.\n", name);
+                return -1;
+            }
+            if (addDirectory(cluster, name) != 0 || (next = lookupDirectory(cluster, name)) == 0)
+                return -1;
+        }
+        cluster = next;
+    }
+}
+
+int initDirectoryCluster(uint32_t newCluster, uint32_t parentCluster)
+{
+    clearCluster(newCluster);
+    // Create '.' and '..' directory entries
+    if (writeDirectoryEntry(newCluster, ".", newCluster, ATTR_DIRECTORY) != 0 ||
+        writeDirectoryEntry(newCluster, "..", parentCluster == bs.rootCluster ? 0 : parentCluster, ATTR_DIRECTORY) != 0)
+    {
+        printf("Failed to write '.' or '..' directory entries.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void clearCluster(uint32_t clusterNumber)
+{
+    uint8_t *data = cacheOverwriteCluster(clusterNumber);
+    if (!data)
+    {
+        printf("Failed to clear cluster %u\n", clusterNumber);
+        return;
+    }
+    memset(data, 0, bs.bytesPerSector * bs.sectorsPerCluster);
+    cacheMarkMetadata(clusterNumber); // Only directories are cleared
+}
+
+bool isDirectoryFull(uint32_t parentCluster)
+{
+    uint32_t entryCluster, slot;
+    return !findFreeDirSlot(parentCluster, &entryCluster, &slot);
+}
+
+int expandDirectory(uint32_t parentCluster)
+{
+    uint32_t newCluster = allocateCluster();
+    if (newCluster == 0)
+    {
+        printf("No free clusters available to allocate for new directory.\n");
+        return -1;
+    }
+
+    clearCluster(newCluster); // A new directory cluster must start out empty
+    if (linkClusterToDirectory(parentCluster, newCluster) != 0)
+    {
+        printf("Failed to link new cluster to extend directory capacity.\n");
+        return -1;
+    }
+
+    return newCluster;
+}
+
+int addDirectory(uint32_t parentCluster, const char *dirName)
+{
+    uint32_t newCluster = allocateCluster();
+    if (newCluster == 0)
+    {
+        printf("No free clusters available to allocate for new directory.\n");
+        return -1;
+    }
+
+    if (writeDirectoryEntry(parentCluster, dirName, newCluster, ATTR_DIRECTORY) != 0)
+    {
+        printf("Failed to write new directory entry.\n");
+        return -1;
+    }
+
+    return initDirectoryCluster(newCluster, parentCluster);
+}
+
+int linkClusterToDirectory(uint32_t directoryCluster, uint32_t newCluster)
+{
+    uint32_t lastCluster = directoryCluster;
+    uint32_t nextCluster;
+
+    while ((nextCluster = readFATEntry(lastCluster)) != 0x0FFFFFFF)
+    {
+        lastCluster = nextCluster; // Follow chain to end
+    }
+
+    // Link the new cluster
+    writeFATEntry(lastCluster, newCluster);
+    writeFATEntry(newCluster, 0x0FFFFFFF); // Mark the new cluster as end of chain
+    dirIndexNoteGrow(lastCluster, newCluster);
+
+    return 0; 
+}
+void processCommand(tokenlist *tokens)
+{
+    pthread_mutex_lock(&imageLock);
+    dispatchCommand(tokens);
+    if (device && durabilityMode == DURABILITY_PER_COMMAND)
+        syncImage();
+    pthread_mutex_unlock(&imageLock);
+}
+
+void dispatchCommand(tokenlist *tokens)
+{
+    if (tokens->size == 0)
+        return;
+    if (!device && strcmp(tokens->items[0], "mount") != 0 && strcmp(tokens->items[0], "exit") != 0)
+    {
+        printf("No image mounted, use mount <image> first.\n");
+        return;
+    }
+
+    if (strcmp(tokens->items[0], "info") == 0)
+    {
+        printInfo();
+    }
+    else if (strcmp(tokens->items[0], "cd") == 0)
+    {
+        if (tokens->size > 1)
+        {
+            if (changeDirectory(tokens->items[1]) == 0)
+            {
+                printf("Changed directory to %s\n", tokens->items[1]);
+            }
+            else
+            {
+                printf("Directory not found: %s\n", tokens->items[1]);
+            }
+        }
+    }
+    else if (strcmp(tokens->items[0], "ls") == 0)
+    {
+        // ls [-l] [--offset N] [--limit N] [path]
+        bool longFormat = false;
+        uint32_t offset = 0, limit = 0;
+        const char *path = NULL;
+        for (int i = 1; i < tokens->size; i++)
+        {
+            if (strcmp(tokens->items[i], "-l") == 0)
+                longFormat = true;
+            else if (strcmp(tokens->items[i], "--offset") == 0 && i + 1 < tokens->size)
+                offset = strtoul(tokens->items[++i], NULL, 10);
+            else if (strcmp(tokens->items[i], "--limit") == 0 && i + 1 < tokens->size)
+                limit = strtoul(tokens->items[++i], NULL, 10);
+            else
+                path = tokens->items[i];
+        }
+        uint32_t cluster = path ? resolveDirectory(path) : currentDirectoryCluster;
+        if (cluster)
+            listDirectory(cluster, longFormat, offset, limit);
+        else
+            printf("Directory not found: %s\n", path);
+    }
+    else if (strcmp(tokens->items[0], "compact") == 0 && tokens->size > 2 && strcmp(tokens->items[1], "--auto") == 0)
+    {
+        autoCompactPercent = strtoul(tokens->items[2], NULL, 10);
+        if (autoCompactPercent)
+            printf("Directories are compacted once %u%% of their entries are deleted.\n", autoCompactPercent);
+        else
+            printf("Automatic compaction disabled.\n");
+    }
+    else if (strcmp(tokens->items[0], "compact") == 0)
+    {
+        uint32_t cluster = (tokens->size > 1) ? resolveDirectory(tokens->items[1]) : currentDirectoryCluster;
+        if (cluster)
+            compactDirectory(cluster);
+        else
+            printf("Directory not found: %s\n", tokens->items[1]);
+    }
+    else if (strcmp(tokens->items[0], "mkdir") == 0 && tokens->size > 2 && strcmp(tokens->items[1], "-p") == 0)
+    {
+        for (int i = 2; i < tokens->size; i++)
+        {
+            if (makeDirectories(tokens->items[i]) == 0)
+                printf("Directory created: %s\n", tokens->items[i]);
+            else
+                printf("Failed to create directory: %s\n", tokens->items[i]);
+        }
+    }
+    else if (strcmp(tokens->items[0], "mkdir") == 0 && tokens->size > 1)
+    {
+        if (createDirectory(tokens->items[1]) == 0)
+        {
+            printf("Directory created: %s\n", tokens->items[1]);
+        }
+        else
+        {
+            printf("Failed to create directory: %s\n", tokens->items[1]);
+        }
+    }
+    else if (strcmp(tokens->items[0], "creat") == 0 && tokens->size > 2 && strcmp(tokens->items[1], "-f") == 0)
+    {
+        createFilesFromManifest(tokens->items[2]);
+    }
+    else if (strcmp(tokens->items[0], "creat") == 0 && tokens->size > 2)
+    {
+        createFiles(tokens->items + 1, tokens->size - 1);
+    }
+    else if (strcmp(tokens->items[0], "creat") == 0 && tokens->size > 1)
+    {
+        if (createFile(tokens->items[1]) == 0)
+        {
+            printf("File '%s' created successfully.\n", tokens->items[1]);
+        }
+        else
+        {
+            printf("Failed to create file: %s\n", tokens->items[1]);
+        }
+    }
+    else if (strcmp(tokens->items[0], "mount") == 0 && tokens->size > 1)
+    {
+        MountOptions options;
+        const char *imageName;
+        initMountOptions(&options);
+        if (parseMountOptions(tokens->size - 1, tokens->items + 1, &options, &imageName) != 0)
+        {
+            printf("Usage: mount <image> [--cache-kb N] [--mmap] [--uring] [--direct] [--ramdisk] [--journal]\n"
+                   "       [--durability none|per-command|periodic] [--sync-ms N]\n");
+        }
+        else if (mountImage(imageName, &options) == 0)
+        {
+            printf("Mounted image: %s\n", tokens->items[1]);
+        }
+        else
+        {
+            printf("Failed to mount image: %s\n", tokens->items[1]);
+        }
+    }
+    else if (strcmp(tokens->items[0], "open") == 0 && tokens->size == 3)
+    {
+        openFile(tokens->items[1], tokens->items[2]);
+    }
+    else if (strcmp(tokens->items[0], "close") == 0 && tokens->size == 2)
+    {
+        closeFile(tokens->items[1]);
+    }
+    else if (strcmp(tokens->items[0], "find") == 0 && tokens->size > 1)
+    {
+        findEntries(tokens->items[1], tokens->size > 2 ? tokens->items[2] : NULL);
+    }
+    else if (strcmp(tokens->items[0], "du") == 0)
+    {
+        diskUsage(tokens->size > 1 ? tokens->items[1] : NULL);
+    }
+    else if (strcmp(tokens->items[0], "tree") == 0)
+    {
+        printTree(tokens->size > 1 ? tokens->items[1] : NULL);
+    }
+    else if (strcmp(tokens->items[0], "lsof") == 0)
+    {
+        listOpenFiles();
+    }
+    else if (strcmp(tokens->items[0], "rm") == 0 && tokens->size > 1)
+    {
+        if (deleteFile(tokens->items[1]))
+        {
+            printf("File '%s' removed successfully.\n", tokens->items[1]);
+        }
+        else
+        {
+            printf("Failed to remove file '%s'.\n", tokens->items[1]);
+        }
+    }
+    else if (strcmp(tokens->items[0], "lseek") == 0 && tokens->size == 3)
+    {
+        const char *filename = tokens->items[1];
+        char *end;
+        errno = 0;
+        unsigned long long offset = strtoull(tokens->items[2], &end, 10);
+        if (*end != '\0' || errno == ERANGE || tokens->items[2][0] == '-' || offset > UINT32_MAX)
+        {
+            printf("Error: Invalid offset '%s'.\n", tokens->items[2]);
+        }
+        else if (seekFile(filename, (uint32_t)offset) == -1)
+        {
+            printf("Failed to set file offset.\n");
+        }
+    }
+    else if (strcmp(tokens->items[0], "read") == 0 && tokens->size == 3)
+    {
+        const char *filename = tokens->items[1];
+        char *end;
+        errno = 0;
+        unsigned long long size = strtoull(tokens->items[2], &end, 10);
+        if (*end != '\0' || errno == ERANGE || tokens->items[2][0] == '-' || size > SIZE_MAX)
+        {
+            printf("Error: Invalid size '%s'.\n", tokens->items[2]);
+        }
+        else if (readFile(filename, (size_t)size) == -1)
+        {
+            printf("Failed to read file: %s\n", filename);
+        }
+    }
+    else if (strcmp(tokens->items[0], "write") == 0 && tokens->size > 2)
+    {
+        // Call writeToFile function with filename and data parameters
+        const char *data = getString(tokens);
+        if (writeToFile(tokens->items[1], data) == 0)
+        {
+            printf("Data written successfully to '%s'.\n", tokens->items[1]);
+        }
+        else
+        {
+            printf("Failed to write data to '%s'.\n", tokens->items[1]);
+        }
+    }
+    else if (strcmp(tokens->items[0], "sync") == 0)
+    {
+        if (syncImage() != 0)
+        {
+            printf("Failed to sync image.\n");
+        }
+    }
+    else if (strcmp(tokens->items[0], "exit") == 0)
+    {
+        if (device)
+            unmountImage(); // Also checkpoints the journal
+        printf("Exiting program.\n");
+        exit(0);
+    }
+    else
+    {
+        // print tokensize
+        printf("Unknown command.\n");
+    }
+}
+
+bool is_8_3_format_directory(const char *name)
+{
+    if (!name)
+        return false;
+    int nameLen = 0, extLen = 0;
+    bool dotSeen = false;
+
+    for (int i = 0; name[i] != '\0'; i++)
+    {
+        if (name[i] == '.')
+        {
+            if (dotSeen)
+                return false; // Only one dot allowed
+            dotSeen = true;
+            continue;
+        }
+        if (!isalnum(name[i]) && name[i] != '_')
+            return false; 
+
+        if (dotSeen)
+        {
+            if (++extLen > 3)
+                return false; 
+        }
+        else
+        {
+            if (++nameLen > 8)
+                return false; 
+        }
+    }
+    return nameLen > 0 && (!dotSeen || extLen > 0); 
+}
+
+bool is_8_3_format_filename(const char *name)
+{
+    int nameLen = 0, extLen = 0;
+    bool dotSeen = false;
+
+    if (name == NULL)
+        return false;
+
+    for (int i = 0; name[i] != '\0'; i++)
+    {
+        // Check if the current character is a dot
+        if (name[i] == '.')
+        {
+            // If a dot is already seen or it appears as the first character, return false
+            if (dotSeen || i == 0)
+                return false;
+            dotSeen = true;
+            continue;
+        }
+
+        if (!isalnum(name[i]) && name[i] != '_')
+            return false;
+
+        if (dotSeen)
+        {
+            extLen++;
+            if (extLen > 3)
+                return false;
+        }
+        else
+        {
+            nameLen++;
+            if (nameLen > 8)
+                return false;
+        }
+    }
+
+    return nameLen > 0 && (!dotSeen || extLen > 0);
+}
+void toUpperCase(char *str)
+{
+    while (*str)
+    {
+        *str = toupper((unsigned char)*str);
+        str++;
+    }
+}
+bool fileExists(const char *filename)
+{
+    uint32_t dirCluster;
+    char leaf[MAX_NAME_LENGTH + 1];
+    if (resolvePath(filename, &dirCluster, leaf) != 0)
+        return false;
+    return findDirEntry(dirCluster, leaf, NULL) != NULL;
+}
+
+int createFile(const char *fileName)
+{
+    uint32_t dirCluster;
+    char leaf[MAX_NAME_LENGTH + 1];
+    if (resolvePath(fileName, &dirCluster, leaf) != 0)
+    {
+        printf("Error: Directory of '%s' not found.\n", fileName);
+        return -1;
+    }
+    if (!is_8_3_format_filename(leaf) && !isValidLongName(leaf))
+    {
+        printf("Error: File name '%s' is not a valid FAT32 name.\n", leaf);
+        return -1;
+    }
+
+    if (findDirEntry(dirCluster, leaf, NULL) != NULL)
+    {
+        printf("Error: A file named '%s' already exists.\n", fileName);
+        return -1;
+    }
+
+    uint32_t fileCluster = allocateCluster();
+    if (fileCluster == 0)
+    {
+        printf("No free clusters available to create the file.\n");
+        return -1;
+    }
+
+    if (writeDirectoryEntry(dirCluster, leaf, fileCluster, 0) != 0)
+    {
+        printf("Failed to write directory entry for the file.\n");
+        return -1;
+    }
+
+    printf("File '%s' created successfully.\n", fileName);
+    return 0;
+}
+
+int compareBatchEntries(const void *a, const void *b)
+{
+    const BatchEntry *left = *(const BatchEntry *const *)a;
+    const BatchEntry *right = *(const BatchEntry *const *)b;
+    if (left->dirCluster != right->dirCluster)
+        return (left->dirCluster > right->dirCluster) - (left->dirCluster < right->dirCluster);
+    return strcasecmp(left->leaf, right->leaf);
+}
+
+int createFiles(char **paths, int count)
+{
+    BatchEntry *entries = malloc(count * sizeof(BatchEntry));
+    BatchEntry **sorted = malloc(count * sizeof(BatchEntry *));
+    uint32_t *clusters = malloc(count * sizeof(uint32_t));
+    if (!entries || !sorted || !clusters)
+    {
+        free(entries);
+        free(sorted);
+        free(clusters);
+        printf("Failed to allocate the creation batch.\n");
+        return -1;
+    }
+
+    // Validate every name first, existing names are answered by the directory indexes
+    int valid = 0;
+    for (int i = 0; i < count; i++)
+    {
+        BatchEntry *entry = &entries[i];
+        entry->path = paths[i];
+        entry->dirCluster = 0;
+        entry->leaf[0] = '\0';
+        entry->skip = true;
+        sorted[i] = entry;
+        if (resolvePath(paths[i], &entry->dirCluster, entry->leaf) != 0)
+            printf("Error: Directory of '%s' not found.\n", paths[i]);
+        else if (!is_8_3_format_filename(entry->leaf) && !isValidLongName(entry->leaf))
+            printf("Error: File name '%s' is not a valid FAT32 name.\n", entry->leaf);
+        else if (findDirEntry(entry->dirCluster, entry->leaf, NULL) != NULL)
+            printf("Error: A file named '%s' already exists.\n", paths[i]);
+        else
+        {
+            entry->skip = false;
+            valid++;
+        }
+    }
+
+    // The same name twice in one batch: only the first is created
+    qsort(sorted, count, sizeof(BatchEntry *), compareBatchEntries);
+    for (int i = 0; i < count;)
+    {
+        int j = i + 1;
+        while (j < count && compareBatchEntries(&sorted[i], &sorted[j]) == 0)
+            j++;
+        BatchEntry *first = NULL;
+        for (int k = i; k < j; k++)
+        {
+            if (!sorted[k]->skip && (!first || sorted[k] < first))
+                first = sorted[k];
+        }
+        for (int k = i; k < j; k++)
+        {
+            if (!sorted[k]->skip && sorted[k] != first)
+            {
+                printf("Error: A file named '%s' already exists.\n", sorted[k]->path);
+                sorted[k]->skip = true;
+                valid--;
+            }
+        }
+        i = j;
+    }
+
+    // Then one allocator pass for all of them
+    int created = 0;
+    if (valid > 0 && allocateClusterBatch(valid, clusters) == 0)
+    {
+        printf("No free clusters available to create %d files.\n", valid);
+        valid = 0;
+    }
+    for (int i = 0, next = 0; i < count && valid > 0; i++)
+    {
+        if (entries[i].skip)
+            continue;
+        uint32_t cluster = clusters[next++];
+        // Entries fill consecutive slots, the flush writes their dirty sectors as runs
+        if (writeDirectoryEntry(entries[i].dirCluster, entries[i].leaf, cluster, 0) != 0)
+        {
+            printf("Failed to write directory entry for '%s'.\n", entries[i].path);
+            clearFATEntry(cluster);
+            continue;
+        }
+        created++;
+    }
+
+    printf("Created %d of %d files.\n", created, count);
+    free(entries);
+    free(sorted);
+    free(clusters);
+    return created == count ? 0 : -1;
+}
+
+int createFilesFromManifest(const char *manifest)
+{
+    FILE *file = fopen(manifest, "r");
+    if (!file)
+    {
+        perror("Failed to open manifest");
+        return -1;
+    }
+    // One path per line, blank lines and lines starting with '#' are skipped
+    char **paths = NULL;
+    int count = 0, capacity = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    int status = 0;
+    while (getline(&line, &lineSize, file) != -1)
+    {
+        char *start = line;
+        while (isspace((unsigned char)*start))
+            start++;
+        size_t length = strlen(start);
+        while (length > 0 && isspace((unsigned char)start[length - 1]))
+            start[--length] = '\0';
+        if (length == 0 || start[0] == '#')
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(paths, capacity * sizeof(char *));
+            if (!grown)
+            {
+                status = -1;
+                break;
+            }
+            paths = grown;
+        }
+        if (!(paths[count] = strdup(start)))
+        {
+            status = -1;
+            break;
+        }
+        count++;
+    }
+    free(line);
+    fclose(file);
+
+    if (status != 0)
+        printf("Failed to read manifest '%s'.\n", manifest);
+    else if (count > 0)
+        status = createFiles(paths, count);
+    for (int i = 0; i < count; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+    return status;
+}
+
+void rightTrim(char *str)
+{
+    int end = strlen(str) - 1;
+    while (end >= 0 && str[end] == ' ')
+    {
+        str[end] = '\0';
+        end--;
+    }
+}
+void initOpenFiles()
+{
+    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        openFiles[i].isOpeninuse = 0; // Mark all entries as unused
+    }
+}
+
+OpenFile *findOpenFile(const char *path)
+{
+    uint32_t dirCluster;
+    char leaf[MAX_NAME_LENGTH + 1];
+    if (resolvePath(path, &dirCluster, leaf) != 0)
+        return NULL;
+    uint8_t fatName[11];
+    if (!resolveShortName(dirCluster, leaf, fatName))
+        return NULL;
+    // Open files are identified by their directory and on-disk name, not by the path typed
+    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    {
+        if (openFiles[i].isOpeninuse && openFiles[i].dirCluster == dirCluster &&
+            memcmp(openFiles[i].fatName, fatName, 11) == 0)
+            return &openFiles[i];
+    }
+    return NULL;
+}
+
+int closeFile(const char *filename)
+{
+    if (!fileExists(filename))
+    {
+        printf("Error: File '%s' does not exist.\n", filename);
+        return -1;
     }
 
     // File exists, proceed to check if it's open and then close it.
+    OpenFile *file = findOpenFile(filename);
+    if (file)
+    {
+        file->isOpeninuse = 0;
+        invalidateExtentMap(file);
+        sessionIdTracker[file->sessionId] = 0; // Free up this session ID
+        printf("File '%s' closed successfully.\n", filename);
+        return 0;
+    }
+
+    printf("Error: File '%s' is not open.\n", filename);
+    return -1;
+}
+
+int findFreeSessionId()
+{
     for (int i = 0; i < MAX_OPEN_FILES; i++)
     {
-        if (openFiles[i].isOpeninuse && strncmp(openFiles[i].filename, filename, sizeof(openFiles[i].filename)) == 0)
+        if (!sessionIdTracker[i])
+        {
+            sessionIdTracker[i] = 1; // Mark this session ID as in use
+            if (i > highestSessionId)
+                highestSessionId = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int globalSessionId = 0;
+bool isValidMode(const char *mode)
+{
+    const char *validModes[] = {"-r", "-w", "-rw", "-wr"};
+    for (int i = 0; i < 4; i++)
+    {
+        if (strcmp(mode, validModes[i]) == 0)
+        {
+            return true; // Mode is valid
+        }
+    }
+    return false;
+}
+int openFile(const char *filename, const char *mode)
+{
+    if (!fileExists(filename))
+    {
+        printf("Error: File '%s' does not exist.\n", filename);
+        return -1;
+    }
+
+    // check mode
+    if (!isValidMode(mode))
+    {
+        printf("Error: invalid mode %s\n", mode);
+        return -1;
+    }
+
+    // Check if the file is already open
+    if (findOpenFile(filename))
+    {
+        printf("Error: File '%s' is already open.\n", filename);
+        return -1; // Return error if the file is already open
+    }
+    int index = -1;
+    for (int i = 0; i < MAX_OPEN_FILES && index == -1; i++)
+    {
+        if (!openFiles[i].isOpeninuse)
+            index = i; // Remember the first unused slot
+    }
+
+    // If we have an unused slot
+    if (index != -1)
+    {
+        char leaf[MAX_NAME_LENGTH + 1];
+        resolvePath(filename, &openFiles[index].dirCluster, leaf);
+        snprintf(openFiles[index].filename, sizeof(openFiles[index].filename), "%s", leaf);
+        snprintf(openFiles[index].path, sizeof(openFiles[index].path), "%s", filename);
+        resolveShortName(openFiles[index].dirCluster, leaf, openFiles[index].fatName);
+        strcpy(openFiles[index].mode, mode + 1);
+        openFiles[index].isOpeninuse = 1; // Mark as in use
+        openFiles[index].offset = 0;
+        openFiles[index].cluster = 0; // Resolved on first read or write
+        openFiles[index].lastReadEnd = 0;
+        openFiles[index].readaheadWindow = 0;
+        openFiles[index].readaheadEnd = 0;
+        openFiles[index].seeked = false;
+        invalidateExtentMap(&openFiles[index]);
+        openFiles[index].sessionId = globalSessionId++;
+        openFiles[index].lastSessionId = openFiles[index].sessionId; // Update last session ID
+        printf("Opened %s\n", filename);
+        printf("mode: %s\n", mode);
+        printf("mode: %s\n", openFiles[index].mode);
+        return index;
+    }
+
+    printf("Error: Too many open files.\n");
+    return -1;
+}
+bool isFileOpenForReading(const char *filename)
+{
+    OpenFile *file = findOpenFile(filename);
+    return file && strchr(file->mode, 'r');
+}
+
+void initDirStack()
+{
+    dirStack.size = 0;
+    for (int i = 0; i < MAX_STACK_SIZE; ++i)
+    {
+        dirStack.directoryPath[i] = NULL;
+    }
+}
+
+void pushDir(const char *dir, uint32_t clusternum)
+{
+    if (dirStack.size < MAX_STACK_SIZE)
+    {
+        dirStack.directoryPath[dirStack.size] = strdup(dir);
+        dirStack.clusterNumber[dirStack.size] = clusternum;
+        dirStack.size++;
+    }
+}
+
+char *popDir()
+{
+    if (dirStack.size > 0)
+    {
+        dirStack.size--;
+        return dirStack.directoryPath[dirStack.size];
+    }
+    return NULL;
+}
+
+void freeDirStack()
+{
+    for (int i = 0; i < dirStack.size; ++i)
+    {
+        free(dirStack.directoryPath[i]);
+    }
+    free(currentPath);
+    currentPath = NULL;
+    currentPathCapacity = 0;
+}
+
+const char *getCurrentDirPath()
+{
+    // Long names make the path up to 255 bytes per level, so size the buffer from the stack
+    size_t needed = 1;
+    for (int i = 0; i < dirStack.size; ++i)
+    {
+        needed += strlen(dirStack.directoryPath[i]) + 1;
+    }
+    if (needed > currentPathCapacity)
+    {
+        char *grown = realloc(currentPath, needed);
+        if (!grown)
+            return currentPath ? currentPath : "";
+        currentPath = grown;
+        currentPathCapacity = needed;
+    }
+
+    size_t used = 0;
+    currentPath[0] = '\0';
+    for (int i = 0; i < dirStack.size; ++i)
+    {
+        used += snprintf(currentPath + used, currentPathCapacity - used, "%s%s",
+                         dirStack.directoryPath[i], (i < dirStack.size - 1) ? "/" : "");
+    }
+    return currentPath;
+}
+
+int writeToFile(const char *filename, const char *data)
+{
+    OpenFile *file = findOpenFile(filename);
+    if (!file || !strchr(file->mode, 'w'))
+    {
+        printf("Error: File '%s' either not open or not open for writing.\n", filename);
+        return -1;
+    }
+
+    dentry_t *entry = findDirEntry(file->dirCluster, file->filename, NULL);
+    if (entry == NULL)
+    {
+        printf("File not found entry is null: %s\n", filename);
+        return -1;
+    }
+
+    uint32_t writeSize = strlen(data);
+    uint32_t cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    uint32_t fileSize = entry->DIR_FileSize;
+    if (writeSize > UINT32_MAX - file->offset)
+    {
+        printf("Error: Writing %u bytes at offset %u would pass the FAT32 file size limit.\n", writeSize, file->offset);
+        return -1;
+    }
+    uint32_t newOffset = file->offset + writeSize;
+    if (file->cluster != cluster)
+    {
+        invalidateExtentMap(file);
+        file->cluster = cluster;
+    }
+
+    if (newOffset > fileSize)
+    {
+        if (!extendOpenFile(file, newOffset))
+        {
+            printf("Error: Unable to extend file '%s'.\n", filename);
+            return -1;
+        }
+
+        updateDirectoryEntrySize(file, newOffset);
+    }
+
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t remaining = writeSize;
+    uint32_t written = 0;
+    cluster = mapFileCluster(file, file->offset);
+    if (remaining > 0 && cluster == 0)
+    {
+        printf("Error: Offset %u is past the end of '%s'.\n", file->offset, filename);
+        return -1;
+    }
+
+    while (remaining > 0)
+    {
+        uint32_t clusterOffset = file->offset % clusterSize;
+        uint32_t toWrite = clusterSize - clusterOffset;
+        toWrite = (remaining < toWrite) ? remaining : toWrite;
+
+        // A write that covers the whole cluster does not need its old contents
+        uint8_t *clusterData = (toWrite == clusterSize) ? cacheOverwriteCluster(cluster) : cacheGetCluster(cluster);
+        if (!clusterData)
+        {
+            printf("Error: Failed to access cluster %u.\n", cluster);
+            return -1;
+        }
+        memcpy(clusterData + clusterOffset, data + written, toWrite);
+        cacheMarkRange(cluster, clusterOffset, toWrite, false);
+
+        written += toWrite;
+        remaining -= toWrite;
+        file->offset += toWrite; // Update file offset
+
+        // Move to the next cluster once this one is filled
+        if (remaining > 0)
+        {
+            cluster = mapFileCluster(file, file->offset);
+            if (cluster == 0)
+            { 
+                printf("Error: No more clusters available.\n");
+                return -1;
+            }
+        }
+    }
+
+    printf("Successfully wrote to file '%s'.\n", filename);
+    return 0;
+}
+
+uint32_t findClusterByOffset(uint32_t startCluster, uint32_t offset)
+{
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t cluster = startCluster;
+    uint32_t clustersToAdvance = offset / clusterSize;
+
+    for (uint32_t i = 0; i < clustersToAdvance; i++)
+    {
+        cluster = readFATEntry(cluster);
+    }
+    return cluster;
+}
+
+void invalidateExtentMap(OpenFile *file)
+{
+    free(file->extents);
+    file->extents = NULL;
+    file->extentCount = 0;
+    file->extentCapacity = 0;
+    file->extentsValid = false;
+}
+
+bool appendExtent(OpenFile *file, uint32_t diskCluster)
+{
+    if (file->extentCount > 0)
+    {
+        ClusterExtent *last = &file->extents[file->extentCount - 1];
+        if (last->diskCluster + last->length == diskCluster)
+        {
+            last->length++; // Physically contiguous, grow the current run
+            return true;
+        }
+    }
+    if (file->extentCount == file->extentCapacity)
+    {
+        uint32_t capacity = file->extentCapacity ? file->extentCapacity * 2 : 8;
+        ClusterExtent *grown = realloc(file->extents, capacity * sizeof(ClusterExtent));
+        if (!grown)
+            return false;
+        file->extents = grown;
+        file->extentCapacity = capacity;
+    }
+    ClusterExtent *extent = &file->extents[file->extentCount];
+    extent->fileCluster = file->extentCount ? file->extents[file->extentCount - 1].fileCluster + file->extents[file->extentCount - 1].length : 0;
+    extent->diskCluster = diskCluster;
+    extent->length = 1;
+    file->extentCount++;
+    return true;
+}
+
+bool extendExtentMap(OpenFile *file, uint32_t fromCluster)
+{
+    // Follow the chain from fromCluster, which is the first cluster not yet mapped
+    uint32_t cluster = fromCluster;
+    while (cluster >= 2 && cluster < 0x0FFFFFF8)
+    {
+        if (!appendExtent(file, cluster))
+        {
+            invalidateExtentMap(file);
+            return false;
+        }
+        cluster = readFATEntry(cluster);
+    }
+    return true;
+}
+
+bool buildExtentMap(OpenFile *file)
+{
+    invalidateExtentMap(file);
+    if (file->cluster < 2 || !extendExtentMap(file, file->cluster))
+        return false;
+    file->extentsValid = true;
+    return true;
+}
+
+ClusterExtent *findExtent(OpenFile *file, uint32_t index)
+{
+    if (file->extentCount == 0)
+        return NULL;
+    // Binary search for the last run starting at or before index
+    uint32_t low = 0, high = file->extentCount;
+    while (high - low > 1)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (file->extents[mid].fileCluster <= index)
+            low = mid;
+        else
+            high = mid;
+    }
+    ClusterExtent *extent = &file->extents[low];
+    if (index < extent->fileCluster || index >= extent->fileCluster + extent->length)
+        return NULL; // Past the end of the chain
+    return extent;
+}
+
+uint32_t mapFileCluster(OpenFile *file, uint32_t offset)
+{
+    if (!file->extentsValid && !buildExtentMap(file))
+        return 0;
+
+    uint32_t index = offset / (bs.bytesPerSector * bs.sectorsPerCluster);
+    ClusterExtent *extent = findExtent(file, index);
+    if (extent == NULL)
+        return 0;
+    return extent->diskCluster + (index - extent->fileCluster);
+}
+
+bool extendOpenFile(OpenFile *file, uint32_t newSize)
+{
+    if (!file->extentsValid && !buildExtentMap(file))
+        return false;
+
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    ClusterExtent *last = &file->extents[file->extentCount - 1];
+    uint32_t chainLength = last->fileCluster + last->length;
+    uint32_t neededClusters = (newSize + clusterSize - 1) / clusterSize;
+    if (neededClusters <= chainLength)
+        return true;
+
+    // The map already knows the tail, so no chain walk is needed to grow it
+    uint32_t firstNew = allocateClusters(neededClusters - chainLength, last->diskCluster + last->length - 1);
+    if (firstNew == 0)
+        return false;
+    return extendExtentMap(file, firstNew);
+}
+
+uint32_t getDirectoryEntryFileSize(uint32_t cluster)
+{
+    // Read the cluster where the file's directory entry is expected to be
+    dentry_t *entry = (dentry_t *)cacheGetCluster(cluster);
+    if (!entry)
+    {
+        printf("Error reading directory entry for file size\n");
+        return 0;
+    }
+
+    for (int i = 0; i < (bs.bytesPerSector * bs.sectorsPerCluster) / sizeof(dentry_t); i++)
+    {
+        if (entry[i].DIR_Name[0] != 0x00 && (uint8_t)entry[i].DIR_Name[0] != 0xE5)
+        {
+            return entry[i].DIR_FileSize;
+        }
+    }
+
+    return 0;
+}
+
+bool extendFile(uint32_t cluster, uint32_t newSize)
+{
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t lastCluster = cluster;
+    uint32_t chainLength = 1;
+    uint32_t nextCluster;
+
+    // Traverse to the end of the cluster chain, counting its length
+    while ((nextCluster = readFATEntry(lastCluster)) < 0x0FFFFFF8)
+    {
+        lastCluster = nextCluster;
+        chainLength++;
+    }
+
+    uint32_t neededClusters = (newSize + clusterSize - 1) / clusterSize;
+    if (neededClusters <= chainLength)
+    {
+        return true; 
+    }
+
+    // Reserve the whole growth at once so it lands in as few runs as possible
+    return allocateClusters(neededClusters - chainLength, lastCluster) != 0;
+}
+
+void updateDirectoryEntrySize(OpenFile *file, uint32_t newSize)
+{
+    uint32_t entryCluster;
+    dentry_t *entry = findDirEntry(file->dirCluster, file->filename, &entryCluster);
+    if (!entry)
+    {
+        printf("Error: Directory entry of '%s' is gone\n", file->filename);
+        return;
+    }
+    entry->DIR_FileSize = newSize;
+    cacheMarkEntry(entryCluster, entry);
+}
+
+const char *getString(const tokenlist *tokens)
+{
+  
+    if (tokens == NULL || tokens->size < 3)
+    {
+        return NULL; 
+    }
+
+    int startIndex = -1;
+    int endIndex = -1;
+
+    // Find the start index of the string enclosed in quotes
+    for (int i = 1; i < tokens->size; i++)
+    {
+        if (tokens->items[i][0] == '"')
         {
-            openFiles[i].isOpeninuse = 0;
-            sessionIdTracker[openFiles[i].sessionId] = 0; // Free up this session ID
-            printf("File '%s' closed successfully.\n", filename);
-            return 0;
+            startIndex = i;
+            break;
         }
     }
 
-    printf("Error: File '%s' is not open.\n", filename);
-    return -1;
-}
-
-int findFreeSessionId()
-{
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    if (startIndex == -1)
     {
-        if (!sessionIdTracker[i])
-        {
-            sessionIdTracker[i] = 1; // Mark this session ID as in use
-            if (i > highestSessionId)
-                highestSessionId = i;
-            return i;
-        }
+        return NULL; // No starting quote found
     }
-    return -1;
-}
 
-int globalSessionId = 0;
-bool isValidMode(const char *mode)
-{
-    const char *validModes[] = {"-r", "-w", "-rw", "-wr"};
-    for (int i = 0; i < 4; i++)
+    // Find the end index of the string enclosed in quotes
+    for (int i = startIndex; i < tokens->size; i++)
     {
-        if (strcmp(mode, validModes[i]) == 0)
+        if (tokens->items[i][strlen(tokens->items[i]) - 1] == '"')
         {
-            return true; // Mode is valid
+            endIndex = i;
+            break;
         }
     }
-    return false;
-}
-int openFile(const char *filename, const char *mode)
-{
-    if (!fileExists(filename))
+
+    if (endIndex == -1)
     {
-        printf("Error: File '%s' does not exist.\n", filename);
-        return -1;
+        return NULL; 
     }
 
-    // check mode
-    if (!isValidMode(mode))
+    // Calculate the total length needed for the substring
+    int totalLength = 0;
+    for (int i = startIndex; i <= endIndex; i++)
     {
-        printf("Error: invalid mode %s\n", mode);
-        return -1;
+        totalLength += strlen(tokens->items[i]) + 1; 
     }
 
-    int index = -1;
-    // Check if the file is already open
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    char *result = (char *)malloc(totalLength);
+    if (!result)
     {
-        if (strncmp(openFiles[i].filename, filename, sizeof(openFiles[i].filename)) == 0 && openFiles[i].isOpeninuse)
-        {
-            printf("Error: File '%s' is already open.\n", filename);
-            return -1; // Return error if the file is already open
-        }
-        if (!openFiles[i].isOpeninuse && index == -1)
+        return NULL; 
+    }
+    result[0] = '\0';
+    for (int i = startIndex; i <= endIndex; i++)
+    {
+        strcat(result, tokens->items[i]);
+        if (i < endIndex)
         {
-            index = i; // Remember the first unused slot
+            strcat(result, " "); 
         }
     }
 
-    // If we have an unused slot
-    if (index != -1)
+    if (result[0] == '"')
     {
-        strncpy(openFiles[index].filename, filename, sizeof(openFiles[index].filename) - 1); // Copy filename
-        strcpy(openFiles[index].mode, mode + 1);
-        openFiles[index].isOpeninuse = 1; // Mark as in use
-        openFiles[index].offset = 0;
-        openFiles[index].sessionId = globalSessionId++;
-        openFiles[index].lastSessionId = openFiles[index].sessionId; // Update last session ID
-        printf("Opened %s\n", filename);
-        printf("mode: %s\n", mode);
-        printf("mode: %s\n", openFiles[index].mode);
-        return index;
+        memmove(result, result + 1, strlen(result)); 
+    }
+    if (result[strlen(result) - 1] == '"')
+    {
+        result[strlen(result) - 1] = '\0'; 
     }
 
-    printf("Error: Too many open files.\n");
-    return -1;
+    return result;
 }
-bool isFileOpenForReading(const char *filename)
+
+void listOpenFiles()
 {
+    printf(" Index Name    File            Mode      Offset  Path\n");
+    printf("------------ --------------- ---------- ------   ----\n");
     for (int i = 0; i < MAX_OPEN_FILES; i++)
     {
-        if (openFiles[i].isOpeninuse && strcmp(openFiles[i].filename, filename) == 0 && ((strchr(openFiles[i].mode, 'r')) || (strcmp(openFiles[i].mode, "rw") == 0)))
+        if (openFiles[i].isOpeninuse)
         {
-            return true;
+            printf("%12d %-15s %-10s %6u %s\n",
+                   openFiles[i].sessionId, openFiles[i].filename, openFiles[i].mode,
+                   openFiles[i].offset, openFiles[i].path);
         }
     }
-    return false;
 }
 
-void initDirStack()
+int seekFile(const char *filename, uint32_t offset)
 {
-    dirStack.size = 0;
-    for (int i = 0; i < MAX_STACK_SIZE; ++i)
+    OpenFile *file = findOpenFile(filename);
+    if (file)
     {
-        dirStack.directoryPath[i] = NULL;
+        // Normally, here we would check if `offset` exceeds the file size
+        // As we cannot do that, we'll simply set the offset
+        if (file->offset != offset)
+        {
+            // A real seek breaks the stream, so the readahead window shrinks.
+            // lastReadEnd is left alone so the next read is not taken as sequential
+            file->readaheadWindow /= 2;
+            file->readaheadEnd = 0;
+            file->seeked = true;
+        }
+        file->offset = offset;
+        printf("Offset of file '%s' set to %u.\n", filename, offset);
+        return 0;
     }
+    printf("Error: File '%s' is not opened or does not exist.\n", filename);
+    return -1;
 }
 
-void pushDir(const char *dir, uint32_t clusternum)
+void adviseSequential(OpenFile *file, uint32_t offset, size_t length)
 {
-    if (dirStack.size < MAX_STACK_SIZE)
+    // Tell the kernel each physical run of a large read will be streamed
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t end = offset + length;
+    while (offset < end)
     {
-        dirStack.directoryPath[dirStack.size] = strdup(dir);
-        dirStack.clusterNumber[dirStack.size] = clusternum;
-        dirStack.size++;
+        uint32_t cluster = mapFileCluster(file, offset);
+        if (cluster == 0)
+            return;
+        uint32_t index = offset / clusterSize;
+        ClusterExtent *extent = findExtent(file, index);
+        uint32_t runClusters = extent->fileCluster + extent->length - index;
+        size_t pageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+        size_t start = (size_t)clusterToSector(cluster) * bs.bytesPerSector;
+        size_t aligned = start & ~pageMask;
+        madvise(imageMap + aligned, start - aligned + (size_t)runClusters * clusterSize, MADV_SEQUENTIAL);
+        offset = (extent->fileCluster + extent->length) * clusterSize;
     }
 }
 
-char *popDir()
+void prefetchFileRange(OpenFile *file, uint32_t start, uint32_t end, bool fragmentsOnly)
 {
-    if (dirStack.size > 0)
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t wanted[PREFETCH_MAX_CLUSTERS];
+    uint32_t wantedCount = 0;
+    for (uint32_t position = start - start % clusterSize; position < end && wantedCount < PREFETCH_MAX_CLUSTERS; position += clusterSize)
     {
-        dirStack.size--;
-        return dirStack.directoryPath[dirStack.size];
+        uint32_t cluster = mapFileCluster(file, position);
+        if (cluster == 0)
+            break;
+        if (fragmentsOnly && !imageMap && end - position > clusterSize)
+        {
+            // Multi-cluster runs are read in one piece later, only batch the fragments
+            ClusterExtent *extent = findExtent(file, position / clusterSize);
+            uint32_t runEnd = (extent->fileCluster + extent->length) * clusterSize;
+            if (runEnd - position > clusterSize)
+            {
+                position = runEnd - clusterSize;
+                continue;
+            }
+        }
+        wanted[wantedCount++] = cluster;
     }
-    return NULL;
+    cachePrefetch(wanted, wantedCount);
 }
 
-void freeDirStack()
+void readAhead(OpenFile *file, uint32_t fileSize)
 {
-    for (int i = 0; i < dirStack.size; ++i)
-    {
-        free(dirStack.directoryPath[i]);
-    }
-}
+    file->lastReadEnd = file->offset;
+    if (file->readaheadWindow == 0)
+        return; // No stream detected yet
 
-char currentPath[128];
-const char *getCurrentDirPath()
-{
-    strcpy(currentPath, "");
-    for (int i = 0; i < dirStack.size; ++i)
-    {
-        strcat(currentPath, dirStack.directoryPath[i]);
-        if (i < dirStack.size - 1)
-        {
-            strcat(currentPath, "/");
-        }
-    }
-    return currentPath;
+    // Load the next window of the chain, skipping what an earlier call already fetched
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t start = file->offset > file->readaheadEnd ? file->offset : file->readaheadEnd;
+    uint64_t end = (uint64_t)file->offset + (uint64_t)file->readaheadWindow * clusterSize;
+    if (end > fileSize)
+        end = fileSize;
+    if (start >= end)
+        return;
+    prefetchFileRange(file, start, end, false);
+    file->readaheadEnd = end;
 }
 
-int writeToFile(const char *filename, const char *data)
+long readFile(const char *filename, size_t size)
 {
-    int fileIndex = -1;
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    if (!isFileOpenForReading(filename))
     {
-        if (openFiles[i].isOpeninuse && strcmp(openFiles[i].filename, filename) == 0 && ((strchr(openFiles[i].mode, 'w')) || (strcmp(openFiles[i].mode, "rw") == 0)))
-        {
-            fileIndex = i;
-            break;
-        }
+        printf("Error: File '%s' is not opened for reading.\n", filename);
+        return -1;
     }
 
-    if (fileIndex == -1)
+    OpenFile *file = findOpenFile(filename);
+    dentry_t *dentry = findDirEntry(file->dirCluster, file->filename, NULL);
+    if (!dentry)
     {
-        printf("Error: File '%s' either not open or not open for writing.\n", filename);
+        printf("Error: File not found\n");
         return -1;
     }
 
-    OpenFile *file = &openFiles[fileIndex];
-    dentry_t *entry = getDentry(filename);
-    if (entry == NULL)
+    uint32_t cluster = ((uint32_t)dentry->DIR_FstClusHI << 16) | dentry->DIR_FstClusLO;
+    uint32_t fileSize = dentry->DIR_FileSize;
+    if (file->cluster != cluster)
     {
-        printf("File not found entry is null: %s\n", filename);
-        return -1;
+        invalidateExtentMap(file);
+        file->cluster = cluster;
     }
-
-    uint32_t writeSize = strlen(data);
-    uint32_t cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-    file->cluster = cluster;
-    uint32_t fileSize = entry->DIR_FileSize;
-    uint32_t newOffset = file->offset + writeSize;
-
-    if (newOffset > fileSize)
+    // A read that starts where the previous one stopped continues a stream,
+    // the first read after a seek keeps the window seekFile shrank
+    if (file->seeked)
+        file->seeked = false;
+    else if (file->offset == file->lastReadEnd)
     {
-        if (!extendFile(file->cluster, newOffset))
-        {
-            printf("Error: Unable to extend file '%s'.\n", filename);
-            return -1;
-        }
-
-        updateDirectoryEntrySize(file->cluster, newOffset);
+        file->readaheadWindow = file->readaheadWindow ? file->readaheadWindow * 2 : READAHEAD_MIN_CLUSTERS;
+        if (file->readaheadWindow > READAHEAD_MAX_CLUSTERS)
+            file->readaheadWindow = READAHEAD_MAX_CLUSTERS;
+    }
+    else
+    {
+        file->readaheadWindow = 0;
+        file->readaheadEnd = 0;
     }
+    // print size_t size
+    printf("amount of characters to read: %zu\n", size);
+    printf("File size: %u bytes\n", fileSize);
+    printf("File offset: %u bytes\n", file->offset);
+    printf("Readahead window: %u clusters\n", file->readaheadWindow);
 
-    uint8_t *writeBuffer = malloc(bs.bytesPerSector * bs.sectorsPerCluster);
-    if (!writeBuffer)
+    if (file->offset >= fileSize)
     {
-        printf("Error: Memory allocation failed.\n");
+        printf("Error: Attempt to read beyond the file size.\n");
         return -1;
     }
 
-    uint32_t remaining = writeSize;
-    uint32_t written = 0;
+    size_t readSize = (size > fileSize - file->offset) ? (fileSize - file->offset) : size;
+    printf("Read size: %zu bytes\n", readSize);
 
-    while (remaining > 0)
+    // Map each piece of the request to its cluster instead of assuming one cluster
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    size_t bytesRead = 0;
+
+    // Data goes to stdout with write, byte for byte. Mapped pieces stay valid and are
+    // gathered for writev, cache and staging pieces are written before they can be reused
+    struct iovec pending[READ_IOV_BATCH];
+    int pendingCount = 0;
+
+    // Submit the reads for every cluster the request touches as one batch
+    prefetchFileRange(file, file->offset, file->offset + readSize, true);
+    while (bytesRead < readSize)
     {
-        uint32_t sector = clusterToSector(cluster);
-        uint32_t sectorOffset = (file->offset + written) % (bs.bytesPerSector * bs.sectorsPerCluster);
-        uint32_t toWrite = bs.bytesPerSector - sectorOffset;
-        toWrite = (remaining < toWrite) ? remaining : toWrite;
+        uint32_t position = file->offset + bytesRead;
+        uint32_t clusterOffset = position % clusterSize;
+        size_t toRead = clusterSize - clusterOffset;
+        if (toRead > readSize - bytesRead)
+            toRead = readSize - bytesRead;
+
+        cluster = mapFileCluster(file, position);
+        if (cluster == 0)
+        {
+            printf("\nError: Cluster chain ends before the file size.\n");
+            return -1;
+        }
+        if (imageMap && bytesRead == 0 && readSize > toRead)
+        {
+            adviseSequential(file, position, readSize);
+        }
 
-        // Read current sector if partial write
-        if (sectorOffset != 0 || toWrite < bs.bytesPerSector)
+        // Bytes left in this physically contiguous run, within the request
+        ClusterExtent *extent = findExtent(file, position / clusterSize);
+        uint64_t runBytes = (uint64_t)(extent->fileCluster + extent->length) * clusterSize - position;
+        if (runBytes > readSize - bytesRead)
+            runBytes = readSize - bytesRead;
+        if (runBytes > IO_RUN_MAX_BYTES)
+            runBytes = IO_RUN_MAX_BYTES;
+        if (!imageMap && runBytes > toRead)
         {
-            if (pread(fd, writeBuffer, bs.bytesPerSector, sector * bs.bytesPerSector) < bs.bytesPerSector)
+            // The run spans several clusters: move it with one large read
+            uint32_t runClusters = (clusterOffset + runBytes + clusterSize - 1) / clusterSize;
+            if (readClusterRun(cluster, runClusters, stagingBuffer) != 0)
+            {
+                printf("\nFailed to read file\n");
+                return -1;
+            }
+            if (!writeOutput(stagingBuffer + clusterOffset, runBytes))
             {
-                free(writeBuffer);
-                perror("Failed to read sector");
+                perror("\nFailed to write output");
                 return -1;
             }
+            bytesRead += runBytes;
+            continue;
         }
 
-        memcpy(writeBuffer + sectorOffset, data + written, toWrite);
-        if (pwrite(fd, writeBuffer, bs.bytesPerSector, sector * bs.bytesPerSector) < bs.bytesPerSector)
+        uint8_t *clusterData = cacheGetCluster(cluster);
+        if (!clusterData)
         {
-            free(writeBuffer);
-            perror("Failed to write sector");
+            printf("\nFailed to read file\n");
             return -1;
         }
-        written += toWrite;
-        remaining -= toWrite;
-        file->offset += toWrite; // Update file offset
-
-        // Move to next sector/cluster if necessary
-        if (sectorOffset + toWrite >= bs.bytesPerSector * bs.sectorsPerCluster)
+        // Write straight from the cached (or mapped) cluster, no staging copy
+        bool written = imageMap ? queueOutput(pending, &pendingCount, clusterData + clusterOffset, toRead)
+                                : writeOutput(clusterData + clusterOffset, toRead);
+        if (!written)
         {
-            cluster = readFATEntry(cluster);
-            if (cluster == 0x0FFFFFFF)
-            { 
-                free(writeBuffer);
-                printf("Error: No more clusters available.\n");
-                return -1;
-            }
+            perror("\nFailed to write output");
+            return -1;
         }
+        bytesRead += toRead;
     }
-
-    free(writeBuffer);
-    printf("Successfully wrote to file '%s'.\n", filename);
-    return 0;
-}
-
-uint32_t findClusterByOffset(uint32_t startCluster, uint32_t offset)
-{
-    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
-    uint32_t cluster = startCluster;
-    uint32_t clustersToAdvance = offset / clusterSize;
-
-    for (uint32_t i = 0; i < clustersToAdvance; i++)
-    {
-        cluster = readFATEntry(cluster);
-    }
-    return cluster;
-}
-
-uint32_t getDirectoryEntryFileSize(uint32_t cluster)
-{
-    uint8_t buffer[bs.bytesPerSector * bs.sectorsPerCluster];
-    uint32_t sector = clusterToSector(cluster);
-
-    // Read the cluster where the file's directory entry is expected to be
-    if (pread(fd, buffer, bs.bytesPerSector * bs.sectorsPerCluster, sector * bs.bytesPerSector) < 0)
+    if (pendingCount > 0 && !writeOutputv(pending, pendingCount))
     {
-        perror("Error reading directory entry for file size");
-        return 0;
+        perror("\nFailed to write output");
+        return -1;
     }
+    printf("\n");
 
-    dentry_t *entry = (dentry_t *)buffer;
-    for (int i = 0; i < (bs.bytesPerSector * bs.sectorsPerCluster) / sizeof(dentry_t); i++)
-    {
-        if (entry[i].DIR_Name[0] != 0x00 && entry[i].DIR_Name[0] != 0xE5)
-        {
-            return entry[i].DIR_FileSize;
-        }
-    }
+    file->offset += bytesRead; // Update the file offset based on actual bytes read
+    printf("offset is %u\n", file->offset);
+    readAhead(file, fileSize);
 
-    return 0;
+    return bytesRead;
 }
 
-bool extendFile(uint32_t cluster, uint32_t newSize)
+dentry_t *getDentryB(const char *fileName, uint8_t *buffer)
 {
-    uint32_t lastCluster = cluster;
-    uint32_t currentCluster = cluster;
-    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
-
-    // Traverse to the end of the cluster chain
-    while (readFATEntry(currentCluster) < 0x0FFFFFF8)
-    {
-        lastCluster = currentCluster;
-        currentCluster = readFATEntry(currentCluster);
-    }
-
-    // Calculate the current size based on the cluster chain length
-    uint32_t currentSize = 0;
-    currentCluster = cluster;
-    while (readFATEntry(currentCluster) < 0x0FFFFFF8)
-    {
-        currentSize += clusterSize;
-        currentCluster = readFATEntry(currentCluster);
-    }
-
-    if (currentSize >= newSize)
+    uint32_t entryCluster;
+    dentry_t *dentry = findDirEntry(currentDirectoryCluster, fileName, &entryCluster);
+    if (dentry == NULL)
     {
-        return true; 
+        return NULL; // File not found
     }
+    // Hand back a copy of the whole cluster with a pointer to the entry inside it
+    uint8_t *clusterData = cacheGetCluster(entryCluster);
+    memcpy(buffer, clusterData, bs.bytesPerSector * bs.sectorsPerCluster);
+    return (dentry_t *)(buffer + ((uint8_t *)dentry - clusterData));
+}
 
-    uint32_t neededSize = newSize - currentSize;
-    while (neededSize > 0)
+dentry_t *getDentry(const char *fileName)
+{
+    dentry_t *dentry = findDirEntry(currentDirectoryCluster, fileName, NULL);
+    if (dentry == NULL)
     {
-        uint32_t newCluster = allocateCluster();
-        if (newCluster == 0)
-        { 
-            return false;
-        }
-        writeFATEntry(lastCluster, newCluster);
-        lastCluster = newCluster;
-        writeFATEntry(newCluster, 0x0FFFFFFF); 
-        neededSize -= clusterSize;
+        return NULL; // File not found
     }
 
-    return true;
+    // Found the file, allocate memory for the dentry to return
+    dentry_t *foundDentry = malloc(sizeof(dentry_t));
+    if (!foundDentry)
+    {
+        printf("Memory allocation failed for dentry\n");
+        return NULL;
+    }
+    memcpy(foundDentry, dentry, sizeof(dentry_t));
+    return foundDentry;
 }
 
-void updateDirectoryEntrySize(uint32_t cluster, uint32_t newSize)
+bool fileIsOpen(const char *filename)
 {
-    uint8_t buffer[bs.bytesPerSector * bs.sectorsPerCluster];
-    uint32_t sector = clusterToSector(cluster);
-
-    // Read the sector containing the directory entry
-    if (pread(fd, buffer, bs.bytesPerSector * bs.sectorsPerCluster, sector * bs.bytesPerSector) < 0)
-    {
-        perror("Error reading sector to update directory entry");
-        return;
-    }
+    return findOpenFile(filename) != NULL;
+}
 
-    dentry_t *entry = (dentry_t *)buffer;
-    for (int i = 0; i < (bs.bytesPerSector * bs.sectorsPerCluster) / sizeof(dentry_t); i++)
+int compactDirectory(uint32_t dirCluster)
+{
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t entriesPerCluster = clusterSize / ENTRY_SIZE;
+    uint32_t *chain = NULL;
+    uint32_t chainCount = 0, chainCapacity = 0;
+    for (uint32_t cluster = dirCluster; cluster >= 2 && cluster < 0x0FFFFFF8; cluster = readFATEntry(cluster))
     {
-        if (entry[i].DIR_Name[0] != 0x00 && entry[i].DIR_Name[0] != 0xE5)
+        if (chainCount == chainCapacity)
         {
-            entry[i].DIR_FileSize = newSize;
-
-            if (pwrite(fd, buffer, bs.bytesPerSector * bs.sectorsPerCluster, sector * bs.bytesPerSector) < 0)
+            chainCapacity = chainCapacity ? chainCapacity * 2 : 16;
+            uint32_t *grown = realloc(chain, chainCapacity * sizeof(uint32_t));
+            if (!grown)
             {
-                perror("Error writing updated directory entry");
-                return;
+                free(chain);
+                printf("Failed to allocate the directory chain.\n");
+                return -1;
             }
-            break;
+            chain = grown;
         }
+        chain[chainCount++] = cluster;
     }
-}
-
-const char *getString(const tokenlist *tokens)
-{
-  
-    if (tokens == NULL || tokens->size < 3)
+    uint8_t *packed = calloc(chainCount ? chainCount : 1, clusterSize);
+    if (chainCount == 0 || !packed)
     {
-        return NULL; 
+        free(chain);
+        free(packed);
+        printf("Failed to read directory at cluster %u\n", dirCluster);
+        return -1;
     }
 
-    int startIndex = -1;
-    int endIndex = -1;
-
-    // Find the start index of the string enclosed in quotes
-    for (int i = 1; i < tokens->size; i++)
+    // Every entry still in use moves up in order, so '.', '..' and long name pieces keep their places
+    uint32_t live = 0, dead = 0;
+    bool ended = false;
+    for (uint32_t i = 0; i < chainCount && !ended; i++)
     {
-        if (tokens->items[i][0] == '"')
+        uint8_t *data = cacheGetCluster(chain[i]);
+        if (!data)
         {
-            startIndex = i;
-            break;
+            free(chain);
+            free(packed);
+            return -1;
+        }
+        for (uint32_t slot = 0; slot < entriesPerCluster; slot++)
+        {
+            uint8_t *entry = data + slot * ENTRY_SIZE;
+            if (entry[0] == 0x00)
+            {
+                ended = true;
+                break;
+            }
+            if (entry[0] == 0xE5)
+                dead++;
+            else
+                memcpy(packed + (size_t)live++ * ENTRY_SIZE, entry, ENTRY_SIZE);
         }
     }
+    uint32_t needed = live ? (live + entriesPerCluster - 1) / entriesPerCluster : 1;
 
-    if (startIndex == -1)
-    {
-        return NULL; // No starting quote found
-    }
-
-    // Find the end index of the string enclosed in quotes
-    for (int i = startIndex; i < tokens->size; i++)
+    // Only sectors whose contents change are rewritten
+    for (uint32_t i = 0; i < needed && (dead > 0 || needed < chainCount); i++)
     {
-        if (tokens->items[i][strlen(tokens->items[i]) - 1] == '"')
+        uint8_t *data = cacheGetCluster(chain[i]);
+        if (!data)
         {
-            endIndex = i;
-            break;
+            free(chain);
+            free(packed);
+            return -1;
+        }
+        for (uint32_t offset = 0; offset < clusterSize; offset += bs.bytesPerSector)
+        {
+            uint8_t *source = packed + (size_t)i * clusterSize + offset;
+            if (memcmp(data + offset, source, bs.bytesPerSector) != 0)
+            {
+                memcpy(data + offset, source, bs.bytesPerSector);
+                cacheMarkRange(chain[i], offset, bs.bytesPerSector, true);
+            }
         }
     }
-
-    if (endIndex == -1)
+    // The unused tail goes back to the free pool in a single FAT update, dropping its cache slots
+    if (needed < chainCount)
     {
-        return NULL; 
+        writeFATEntry(chain[needed - 1], 0x0FFFFFFF);
+        clearFATEntries(chain[needed]);
     }
+    dirIndexInvalidate(dirCluster);
+    dentryCacheForgetDirectory(dirCluster);
 
-    // Calculate the total length needed for the substring
-    int totalLength = 0;
-    for (int i = startIndex; i <= endIndex; i++)
-    {
-        totalLength += strlen(tokens->items[i]) + 1; 
-    }
+    printf("Compacted directory at cluster %u: %u deleted entries dropped, %u clusters freed.\n",
+           dirCluster, dead, chainCount - needed);
+    free(chain);
+    free(packed);
+    return 0;
+}
 
-    char *result = (char *)malloc(totalLength);
-    if (!result)
-    {
-        return NULL; 
-    }
-    result[0] = '\0';
-    for (int i = startIndex; i <= endIndex; i++)
+void maybeCompactDirectory(uint32_t dirCluster)
+{
+    if (autoCompactPercent == 0)
+        return;
+    DirIndex *index = dirIndexGet(dirCluster);
+    if (!index)
+        return;
+    uint32_t entriesPerCluster = bs.bytesPerSector * bs.sectorsPerCluster / ENTRY_SIZE;
+    uint64_t slots = (uint64_t)index->endPos * entriesPerCluster + index->endSlot;
+    if (index->tombstones >= COMPACT_MIN_TOMBSTONES && index->tombstones * 100 >= slots * autoCompactPercent)
+        compactDirectory(dirCluster);
+}
+
+int walkThreadCount()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        return 1;
+    return cores > WALK_MAX_THREADS ? WALK_MAX_THREADS : (int)cores;
+}
+
+bool walkPush(TreeWalk *walk, WalkDeque *deque, char *path, uint32_t cluster, int depth)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity)
     {
-        strcat(result, tokens->items[i]);
-        if (i < endIndex)
+        // Slide the live part down before growing
+        int live = deque->tail - deque->head;
+        if (deque->head > 0 && live < deque->capacity / 2)
+            memmove(deque->tasks, deque->tasks + deque->head, live * sizeof(WalkTask));
+        else
         {
-            strcat(result, " "); 
+            int capacity = deque->capacity ? deque->capacity * 2 : 64;
+            WalkTask *grown = realloc(deque->tasks, capacity * sizeof(WalkTask));
+            if (!grown)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return false;
+            }
+            memmove(grown, grown + deque->head, live * sizeof(WalkTask));
+            deque->tasks = grown;
+            deque->capacity = capacity;
         }
+        deque->head = 0;
+        deque->tail = live;
     }
+    deque->tasks[deque->tail++] = (WalkTask){path, cluster, depth};
+    pthread_mutex_lock(&walk->idleLock);
+    walk->pending++;
+    walk->queued++;
+    pthread_cond_signal(&walk->workReady); // Wake one idle worker to steal it
+    pthread_mutex_unlock(&walk->idleLock);
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
 
-    if (result[0] == '"')
+bool walkPop(WalkDeque *deque, WalkTask *task)
+{
+    // The owner takes the newest directory, keeping its walk depth-first and cache-warm
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->tail > deque->head;
+    if (found)
+        *task = deque->tasks[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+bool walkSteal(WalkDeque *deque, WalkTask *task)
+{
+    // Thieves take the oldest, which tends to be the largest remaining subtree
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->tail > deque->head;
+    if (found)
+        *task = deque->tasks[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+bool walkRead(uint8_t *buffer, size_t length, off_t offset)
+{
+    // Positional reads straight from the device: no cache, no shared staging buffer
+    size_t done = 0;
+    while (done < length)
     {
-        memmove(result, result + 1, strlen(result)); 
+        struct iovec iov = {buffer + done, length - done};
+        ssize_t n = device->read(device, &iov, 1, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
     }
-    if (result[strlen(result) - 1] == '"')
+    return true;
+}
+
+bool walkAddRecord(WalkWorker *worker, char *path, uint32_t size, uint32_t clusters, uint8_t attr)
+{
+    if (worker->count == worker->capacity)
     {
-        result[strlen(result) - 1] = '\0'; 
+        size_t capacity = worker->capacity ? worker->capacity * 2 : 256;
+        WalkRecord *grown = realloc(worker->records, capacity * sizeof(WalkRecord));
+        if (!grown)
+            return false;
+        worker->records = grown;
+        worker->capacity = capacity;
     }
+    worker->records[worker->count++] = (WalkRecord){path, size, clusters, attr};
+    return true;
+}
 
-    return result;
+uint32_t chainLength(uint32_t cluster)
+{
+    uint32_t length = 0;
+    while (cluster >= 2 && cluster < 0x0FFFFFF8 && length < clusterLimit)
+    {
+        length++;
+        cluster = readFATEntry(cluster);
+    }
+    return length;
 }
 
-void listOpenFiles()
+void walkDirectory(WalkWorker *worker, WalkTask *task)
 {
-    printf(" Index Name    File            Mode      Offset  Path\n");
-    printf("------------ --------------- ---------- ------   ----\n");
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    uint32_t clusterSize = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t entriesPerCluster = clusterSize / ENTRY_SIZE;
+    LfnState lfn;
+    lfnReset(&lfn);
+    uint32_t cluster = task->cluster, visited = 0;
+    bool ended = false;
+    while (!ended && cluster >= 2 && cluster < 0x0FFFFFF8 && visited < clusterLimit)
     {
-        if (openFiles[i].isOpeninuse)
+        // The FAT stays in memory and unchanged during a walk, so following chains needs no lock
+        uint32_t run = 1, next = readFATEntry(cluster);
+        while (run < WALK_RUN_CLUSTERS && next == cluster + run)
         {
-            printf("%12d %-15s %-10s %6d %s\n",
-                   openFiles[i].sessionId, openFiles[i].filename, openFiles[i].mode,
-                   openFiles[i].offset, "fat32.img");
+            next = readFATEntry(next);
+            run++;
+        }
+        if (!walkRead(worker->buffer, (size_t)run * clusterSize, (off_t)clusterToSector(cluster) * bs.bytesPerSector))
+        {
+            worker->failed = true;
+            return;
+        }
+
+        for (uint32_t i = 0; i < run * entriesPerCluster; i++)
+        {
+            uint8_t *entry = worker->buffer + i * ENTRY_SIZE;
+            if (entry[0] == 0x00)
+            {
+                ended = true;
+                break;
+            }
+            if (entry[0] == 0xE5)
+            {
+                lfnReset(&lfn);
+                continue;
+            }
+            if ((entry[11] & 0x0F) == ATTR_LONG_NAME)
+            {
+                lfnAccept(&lfn, entry);
+                continue;
+            }
+            if ((entry[11] & 0x08) || memcmp(entry, ".          ", 11) == 0 || memcmp(entry, "..         ", 11) == 0)
+            {
+                lfnReset(&lfn);
+                continue; // Volume label and dot entries
+            }
+
+            char name[LFN_NAME_BUFFER];
+            if (!lfnFinish(&lfn, entry, name, sizeof(name)))
+                shortNameToString(entry, name);
+            size_t length = strlen(task->path) + strlen(name) + 2;
+            char *path = malloc(length);
+            if (!path)
+            {
+                worker->failed = true;
+                return;
+            }
+            snprintf(path, length, "%s/%s", task->path, name);
+            dentry_t *dentry = (dentry_t *)entry;
+            uint32_t first = ((uint32_t)dentry->DIR_FstClusHI << 16) | dentry->DIR_FstClusLO;
+            if (!walkAddRecord(worker, path, dentry->DIR_FileSize, chainLength(first), dentry->DIR_Attr))
+            {
+                free(path);
+                worker->failed = true;
+                return;
+            }
+            if ((dentry->DIR_Attr & ATTR_DIRECTORY) && first >= 2 && first < clusterLimit && task->depth < WALK_MAX_DEPTH)
+            {
+                char *childPath = strdup(path);
+                if (!childPath || !walkPush(worker->walk, &worker->walk->deques[worker->id], childPath, first, task->depth + 1))
+                {
+                    free(childPath);
+                    worker->failed = true;
+                }
+            }
         }
+        cluster = next;
+        visited += run;
     }
 }
 
-int seekFile(const char *filename, long offset)
+void *walkWorkerMain(void *arg)
 {
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    WalkWorker *worker = arg;
+    TreeWalk *walk = worker->walk;
+    while (true)
     {
-        if (openFiles[i].isOpeninuse && strcmp(openFiles[i].filename, filename) == 0)
+        WalkTask task;
+        bool found = walkPop(&walk->deques[worker->id], &task);
+        for (int i = 1; !found && i < walk->workerCount; i++)
+            found = walkSteal(&walk->deques[(worker->id + i) % walk->workerCount], &task);
+        pthread_mutex_lock(&walk->idleLock);
+        if (!found)
         {
-            // Normally, here we would check if `offset` exceeds the file size
-            // As we cannot do that, we'll simply set the offset
-            openFiles[i].offset = offset;
-            printf("Offset of file '%s' set to %ld.\n", filename, offset);
-            return 0;
+            // Nothing to take: sleep until a directory is pushed, done once no
+            // other worker can still add one
+            while (walk->queued == 0 && walk->pending > 0)
+                pthread_cond_wait(&walk->workReady, &walk->idleLock);
+            bool done = walk->pending == 0;
+            pthread_mutex_unlock(&walk->idleLock);
+            if (done)
+                return NULL;
+            continue;
         }
+        walk->queued--;
+        pthread_mutex_unlock(&walk->idleLock);
+
+        walkDirectory(worker, &task);
+        free(task.path);
+        pthread_mutex_lock(&walk->idleLock);
+        if (--walk->pending == 0)
+            pthread_cond_broadcast(&walk->workReady);
+        pthread_mutex_unlock(&walk->idleLock);
     }
-    printf("Error: File '%s' is not opened or does not exist.\n", filename);
-    return -1;
 }
 
-int readFile(const char *filename, size_t size)
+int walkTree(uint32_t dirCluster, const char *rootPath, WalkRecord **records, size_t *count)
 {
-    if (!isFileOpenForReading(filename))
-    {
-        printf("Error: File '%s' is not opened for reading.\n", filename);
+    // Put everything the cache holds on disk, the workers read the device directly
+    int status = cacheFlush();
+    if (journalActive && journalCommit() != 0)
+        status = -1;
+    if (status != 0)
         return -1;
+
+    TreeWalk walk = {0};
+    pthread_mutex_init(&walk.idleLock, NULL);
+    pthread_cond_init(&walk.workReady, NULL);
+    walk.workerCount = walkThreadCount();
+    walk.deques = calloc(walk.workerCount, sizeof(WalkDeque));
+    walk.workers = calloc(walk.workerCount, sizeof(WalkWorker));
+    pthread_t *threads = calloc(walk.workerCount, sizeof(pthread_t));
+    size_t bufferSize = (size_t)WALK_RUN_CLUSTERS * bs.bytesPerSector * bs.sectorsPerCluster;
+    bool ready = walk.deques && walk.workers && threads;
+    for (int i = 0; ready && i < walk.workerCount; i++)
+    {
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+        walk.workers[i].walk = &walk;
+        walk.workers[i].id = i;
+        walk.workers[i].buffer = alignedAlloc(bufferSize);
+        ready = walk.workers[i].buffer != NULL;
+    }
+    char *start = ready ? strdup(rootPath) : NULL;
+    if (start && !walkPush(&walk, &walk.deques[0], start, dirCluster, 0))
+    {
+        free(start);
+        start = NULL;
     }
 
-    int fileIndex = -1;
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    int started = 0;
+    if (start)
     {
-        if (strcmp(openFiles[i].filename, filename) == 0)
+        for (; started < walk.workerCount; started++)
         {
-            fileIndex = i;
-            break;
+            if (pthread_create(&threads[started], NULL, walkWorkerMain, &walk.workers[started]) != 0)
+                break;
         }
+        if (started == 0)
+            walkWorkerMain(&walk.workers[0]); // No threads to be had, walk on this one
     }
-    if (fileIndex == -1)
+    for (int i = 0; i < started; i++)
     {
-        printf("Error: File '%s' not found.\n", filename);
-        return -1;
+        pthread_join(threads[i], NULL);
     }
 
-    OpenFile *file = &openFiles[fileIndex];
-    dentry_t *dentry = getDentry(filename);
-    if (!dentry)
+    // Merge the per-worker results
+    size_t total = 0;
+    bool failed = !start;
+    for (int i = 0; walk.workers && i < walk.workerCount; i++)
     {
-        printf("Error: File not found\n");
-        return -1;
+        total += walk.workers[i].count;
+        failed = failed || walk.workers[i].failed;
     }
-
-    uint32_t cluster = ((uint32_t)dentry->DIR_FstClusHI << 16) | dentry->DIR_FstClusLO;
-    uint32_t fileSize = dentry->DIR_FileSize;
-    // print size_t size
-    printf("amount of characters to read: %lu\n", size);
-    printf("File size: %u bytes\n", fileSize);
-    printf("File offset: %u bytes\n", file->offset);
-
-    if (file->offset >= fileSize)
+    *records = malloc((total ? total : 1) * sizeof(WalkRecord));
+    *count = 0;
+    for (int i = 0; walk.workers && i < walk.workerCount; i++)
     {
-        printf("Error: Attempt to read beyond the file size.\n");
-        return -1;
+        WalkWorker *worker = &walk.workers[i];
+        if (*records)
+        {
+            memcpy(*records + *count, worker->records, worker->count * sizeof(WalkRecord));
+            *count += worker->count;
+        }
+        else
+            freeWalkRecords(worker->records, worker->count);
+        free(worker->records);
+        free(worker->buffer);
+        if (walk.deques)
+            pthread_mutex_destroy(&walk.deques[i].lock);
+        free(walk.deques ? walk.deques[i].tasks : NULL);
     }
+    free(walk.deques);
+    free(walk.workers);
+    free(threads);
+    pthread_cond_destroy(&walk.workReady);
+    pthread_mutex_destroy(&walk.idleLock);
+    if (!*records)
+        failed = true;
+    if (failed)
+        printf("The tree walk did not finish, results are incomplete.\n");
+    return failed ? -1 : 0;
+}
 
-    size_t readSize = ((file->offset + size) > fileSize) ? (fileSize - file->offset) : size;
-    printf("Read size: %zu bytes\n", readSize);
-
-    uint8_t *buffer = malloc(readSize + 1);
-    if (!buffer)
+void freeWalkRecords(WalkRecord *records, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
     {
-        perror("Memory allocation failed");
-        return -1;
+        free(records[i].path);
     }
+}
 
-    uint32_t sector = clusterToSector(cluster);
-    ssize_t bytesRead = pread(fd, buffer, readSize, sector * bs.bytesPerSector + file->offset);
-    if (bytesRead < 0)
+int compareWalkRecords(const void *a, const void *b)
+{
+    // '/' sorts before every other character, so a directory's contents follow it directly
+    const unsigned char *left = (const unsigned char *)((const WalkRecord *)a)->path;
+    const unsigned char *right = (const unsigned char *)((const WalkRecord *)b)->path;
+    while (*left && *left == *right)
     {
-        perror("Failed to read file");
-        free(buffer);
-        return -1;
+        left++;
+        right++;
     }
+    int l = (*left == '/') ? 1 : (*left ? *left + 1 : 0);
+    int r = (*right == '/') ? 1 : (*right ? *right + 1 : 0);
+    return l - r;
+}
 
-    buffer[bytesRead] = '\0'; 
-    printf("%s\n", buffer);
-
-    file->offset += bytesRead; // Update the file offset based on actual bytes read
-    printf("offset is %u\n", file->offset);
-
-    free(buffer);
-    return bytesRead;
+const char *walkRootPath(const char *path, char *rootPath)
+{
+    // Records are named from this prefix; "/" becomes "" so paths read "/A/B"
+    snprintf(rootPath, MAX_PATH_LENGTH, "%s", path ? path : ".");
+    size_t length = strlen(rootPath);
+    while (length > 0 && rootPath[length - 1] == '/')
+        rootPath[--length] = '\0';
+    return rootPath;
 }
 
-dentry_t *getDentryB(const char *fileName, uint8_t *buffer)
+void findEntries(const char *pattern, const char *path)
 {
-    char fileNameUpper[12]; 
-    strncpy(fileNameUpper, fileName, 11);
-    fileNameUpper[11] = '\0'; 
-    // Convert dirNameUpper to uppercase
-    for (int i = 0; fileNameUpper[i]; i++)
+    uint32_t cluster = path ? resolveDirectory(path) : currentDirectoryCluster;
+    if (!cluster)
     {
-        fileNameUpper[i] = toupper(fileNameUpper[i]);
+        printf("Directory not found: %s\n", path);
+        return;
     }
-    uint32_t cluster = currentDirectoryCluster;
-    do
+    char rootPath[MAX_PATH_LENGTH];
+    WalkRecord *records;
+    size_t count;
+    walkTree(cluster, walkRootPath(path, rootPath), &records, &count);
+
+    qsort(records, count, sizeof(WalkRecord), compareWalkRecords);
+    OutputBuffer out;
+    bool buffered = outInit(&out, OUTPUT_BUFFER_SIZE);
+    size_t matches = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        readCluster(cluster, buffer);
-        dentry_t *dentry = (dentry_t *)buffer;
-        for (int i = 0; i < bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t); i++, dentry++)
+        const char *name = strrchr(records[i].path, '/') + 1;
+        if (fnmatch(pattern, name, FNM_CASEFOLD) == 0)
         {
-            char name[12];
-            memset(name, ' ', 11); 
-            memcpy(name, dentry->DIR_Name, 11);
-            name[11] = '\0';
-
-            for (int j = 0; j < 11; j++)
-            {
-                if (name[j] == ' ')
-                    name[j] = '\0'; // Stop at first space
-                else
-                    name[j] = toupper(name[j]);
-            }
-            if (strncmp(name, fileNameUpper, 11) == 0 && dentry->DIR_Name[0] != 0xE5)
-            {
-                return dentry; // Return the pointer directly pointing to the buffer
-            }
+            matches++;
+            if (buffered)
+                outPrintf(&out, "%s%s\n", records[i].path, (records[i].attr & ATTR_DIRECTORY) ? "/" : "");
         }
-        cluster = readFATEntry(cluster);
-    } while (cluster < 0x0FFFFFF8);
-
-    return NULL; // File not found
+    }
+    if (buffered)
+        outFree(&out);
+    printf("%zu match(es)\n", matches);
+    freeWalkRecords(records, count);
+    free(records);
 }
 
-dentry_t *getDentry(const char *fileName)
+void diskUsage(const char *path)
 {
-    uint8_t *buffer = malloc(bs.bytesPerSector * bs.sectorsPerCluster);
-    if (!buffer)
+    uint32_t cluster = path ? resolveDirectory(path) : currentDirectoryCluster;
+    if (!cluster)
     {
-        printf("Memory allocation failed\n");
-        return NULL;
-    }
-
-    char fileNameUpper[12];
-    strncpy(fileNameUpper, fileName, 11);
-    fileNameUpper[11] = '\0'; 
-
-    for (int i = 0; fileNameUpper[i]; i++)
-    {
-        fileNameUpper[i] = toupper(fileNameUpper[i]);
+        printf("Directory not found: %s\n", path);
+        return;
     }
-
-    uint32_t cluster = currentDirectoryCluster; 
-    do
+    char rootPath[MAX_PATH_LENGTH];
+    WalkRecord *records;
+    size_t count;
+    walkTree(cluster, walkRootPath(path, rootPath), &records, &count);
+
+    uint64_t bytes = 0, clusters = chainLength(cluster);
+    size_t files = 0, directories = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        readCluster(cluster, buffer);
-        dentry_t *dentry = (dentry_t *)buffer;
-        for (int i = 0; i < bs.bytesPerSector * bs.sectorsPerCluster / sizeof(dentry_t); i++, dentry++)
+        clusters += records[i].clusters;
+        if (records[i].attr & ATTR_DIRECTORY)
+            directories++;
+        else
         {
-          
-            char name[12];
-            memset(name, ' ', 11); 
-            memcpy(name, dentry->DIR_Name, 11);
-            name[11] = '\0';
-
-           
-            for (int j = 0; j < 11; j++)
-            {
-                if (name[j] == ' ')
-                    name[j] = '\0'; 
-                else
-                    name[j] = toupper(name[j]);
-            }
-
-            if (strcmp(name, fileNameUpper) == 0)
-            {
-                // Found the file, allocate memory for the dentry to return
-                dentry_t *foundDentry = malloc(sizeof(dentry_t));
-                if (!foundDentry)
-                {
-                    printf("Memory allocation failed for dentry\n");
-                    free(buffer);
-                    return NULL;
-                }
-                memcpy(foundDentry, dentry, sizeof(dentry_t));
-                free(buffer);
-                return foundDentry;
-            }
+            files++;
+            bytes += records[i].size;
         }
-        cluster = readFATEntry(cluster);
-    } while (cluster < 0x0FFFFFF8); 
-
-    free(buffer);
-    return NULL; // File not found
+    }
+    printf("%s: %zu files, %zu directories, %llu bytes in files, %llu bytes allocated\n",
+           rootPath[0] ? rootPath : "/", files, directories, (unsigned long long)bytes,
+           (unsigned long long)(clusters * bs.bytesPerSector * bs.sectorsPerCluster));
+    freeWalkRecords(records, count);
+    free(records);
 }
 
-bool fileIsOpen(const char *filename)
+void printTree(const char *path)
 {
-
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    uint32_t cluster = path ? resolveDirectory(path) : currentDirectoryCluster;
+    if (!cluster)
     {
-        if (openFiles[i].isOpeninuse && strcmp(openFiles[i].filename, filename) == 0)
+        printf("Directory not found: %s\n", path);
+        return;
+    }
+    char rootPath[MAX_PATH_LENGTH];
+    WalkRecord *records;
+    size_t count;
+    walkTree(cluster, walkRootPath(path, rootPath), &records, &count);
+
+    qsort(records, count, sizeof(WalkRecord), compareWalkRecords);
+    OutputBuffer out;
+    if (outInit(&out, OUTPUT_BUFFER_SIZE))
+    {
+        outPrintf(&out, "%s\n", rootPath[0] ? rootPath : "/");
+        size_t rootLength = strlen(rootPath);
+        for (size_t i = 0; i < count; i++)
         {
-            return true; 
+            // One level of indentation per component below the root
+            int depth = 0;
+            for (const char *p = records[i].path + rootLength + 1; *p; p++)
+                depth += (*p == '/');
+            const char *name = strrchr(records[i].path, '/') + 1;
+            if (records[i].attr & ATTR_DIRECTORY)
+                outPrintf(&out, "%*s%s/\n", (depth + 1) * 2, "", name);
+            else
+                outPrintf(&out, "%*s%s (%u bytes)\n", (depth + 1) * 2, "", name, records[i].size);
         }
+        outFree(&out);
     }
-    return false;
+    freeWalkRecords(records, count);
+    free(records);
 }
 
 void clearFATEntries(uint32_t cluster)
 {
-    while (cluster != 0x0FFFFFFF && cluster < 0x0FFFFFF8)
+    while (cluster >= 2 && cluster < 0x0FFFFFF8)
     {
         uint32_t nextCluster = readFATEntry(cluster);
         clearFATEntry(cluster);                      // Set the current cluster's FAT entry to 0
@@ -1612,16 +5811,8 @@ void clearFATEntries(uint32_t cluster)
 
 void clearFATEntry(uint32_t cluster)
 {
-    uint32_t fatOffset = cluster * 4;
-    uint32_t fatSector = bs.reservedSectors + (fatOffset / bs.bytesPerSector);
-    uint32_t entOffset = fatOffset % bs.bytesPerSector;
-
-    uint8_t sectorBuffer[bs.bytesPerSector];
-    pread(fd, sectorBuffer, bs.bytesPerSector, fatSector * bs.bytesPerSector);
-
-    memset(sectorBuffer + entOffset, 0, sizeof(uint32_t)); // Clear the FAT entry
-
-    pwrite(fd, sectorBuffer, bs.bytesPerSector, fatSector * bs.bytesPerSector); // Write back the FAT sector
+    cacheDiscard(cluster);     // Drop its cached data before the cluster can be handed out again
+    writeFATEntry(cluster, 0); // Set the FAT entry to free
 }
 
 bool deleteFile(const char *filename)
@@ -1632,27 +5823,29 @@ bool deleteFile(const char *filename)
         return false;
     }
 
-    uint8_t buffer[bs.bytesPerSector * bs.sectorsPerCluster];
-    dentry_t *entry = getDentryB(filename, buffer);
+    uint32_t dirCluster, entryCluster;
+    char leaf[MAX_NAME_LENGTH + 1];
+    dentry_t *entry = NULL;
+    if (resolvePath(filename, &dirCluster, leaf) == 0)
+        entry = findDirEntry(dirCluster, leaf, &entryCluster);
     if (entry == NULL)
     {
         printf("File not found entry is null: %s\n", filename);
         return false;
     }
 
-    memset(entry->DIR_Name, 0, 11); // Clear the filename
-
-
-    uint32_t sector = clusterToSector(currentDirectoryCluster);
-    if (pwrite(fd, buffer, sizeof(buffer), sector * bs.bytesPerSector) < sizeof(buffer))
-    {
-        perror("Failed to write modified directory sector");
-        return false;
-    }
-
     uint32_t fileCluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-    clearFATEntries(fileCluster);
+    uint32_t slot = entry - (dentry_t *)cacheGetCluster(entryCluster);
+    dentryCacheStore(dirCluster, (uint8_t *)entry->DIR_Name, false, 0, 0);
+    dentryCacheForgetDirectory(fileCluster);
+    dirIndexNoteRemove(entryCluster, (uint8_t *)entry->DIR_Name);
+    deleteLongNameEntries(dirCluster, entryCluster, slot); // May move the cache, look the entry up again
+    entry = (dentry_t *)cacheGetCluster(entryCluster) + slot;
     entry->DIR_Name[0] = 0xE5; // Mark the file as deleted.
+    cacheMarkEntry(entryCluster, entry);
+    dirIndexInvalidate(fileCluster); // In case it was a directory, its clusters are about to be reused
+    clearFATEntries(fileCluster);
+    maybeCompactDirectory(dirCluster);
 
     printf("File '%s' removed successfully.\n", filename);
     return true;